@@ -9,6 +9,6 @@ QT = core \
      svg \
      network
 
-HEADERS = chess.hpp chess_gui.hpp \
+HEADERS = chess_gui.hpp
 
 SOURCES = main.cpp
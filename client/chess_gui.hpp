@@ -1,247 +1,279 @@
 #ifndef CHESS_GUI_HPP
 #define CHESS_GUI_HPP
 
+#include <cstdlib>
+#include <cstring>
+#include <string>
 #include <QApplication>
 #include <QDesktopWidget>
 #include <QWidget>
-#include <QSvgWidget>
+#include <QSvgRenderer>
+#include <QPainter>
+#include <QPixmap>
 #include <QRect>
+#include <QRectF>
 #include <QPoint>
 #include <QSize>
 #include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+#include <QQueue>
+#include <QKeyEvent>
 #include <QMouseEvent>
+#include <QPaintEvent>
+#include <QResizeEvent>
 #include <QTcpSocket>
-#include "../chess.hpp"
+#include <QTimer>
+#include <QElapsedTimer>
+#include "../server/protocol.hpp"
 
-class PieceWidget : public QSvgWidget {
-public:
-	PieceWidget(QWidget *parent=0) : QSvgWidget(parent) {}
-	
-	void moveCenter(const QPoint& pos) {
-		QRect rect = geometry();
-		rect.moveCenter(pos);
-		setGeometry(rect);
-	}
-};
+// The piece and square images rasterized side by side into one pixmap. The
+// SVGs are rendered again only when the square size changes.
+class PieceAtlas {
+	QPixmap	mPixmap;
+	int		mSize;
 
-class PawnWidget : public PieceWidget, public Pawn {
 public:
-	PawnWidget(int color, QWidget *parent=0) : PieceWidget(parent), Pawn(color) {
-		if (color == Piece::WHITE) load( QString("img/wp.svg") );
-		else load( QString("img/bp.svg") );
-	}
-};
+	enum { LIGHT_SQUARE = 12, DARK_SQUARE = 13, TILES = 14 };
 
-class KnightWidget : public PieceWidget, public Knight {
-public:
-	KnightWidget(int color, QWidget *parent=0) : PieceWidget(parent), Knight(color) {
-		if (color == Piece::WHITE) load( QString("img/wn.svg") );
-		else load( QString("img/bn.svg") );
-	}
-};
+	PieceAtlas() { mSize = 0; }
 
-class BishopWidget : public PieceWidget, public Bishop {
-public:
-	BishopWidget(int color, QWidget *parent=0) : PieceWidget(parent), Bishop(color) {
-		if (color == Piece::WHITE) load( QString("img/wb.svg") );
-		else load( QString("img/bb.svg") );
-	}
-};
-
-class RookWidget : public PieceWidget, public Rook {
-public:
-	RookWidget(int color, QWidget *parent=0) : PieceWidget(parent), Rook(color) {
-		if (color == Piece::WHITE) load( QString("img/wr.svg") );
-		else load( QString("img/br.svg") );
+	void render(int size) {
+		static const char *files[TILES] = {
+			"wp", "wn", "wb", "wr", "wq", "wk", "bp", "bn", "bb", "br", "bq", "bk", "sq_w", "sq_b"
+		};
+		if (size == mSize || size <= 0) return;
+		mSize = size;
+		mPixmap = QPixmap(size * TILES, size);
+		mPixmap.fill(Qt::transparent);
+		QPainter painter(&mPixmap);
+		for (int i = 0; i < TILES; ++i) {
+			QSvgRenderer svg( QString("img/%1.svg").arg(files[i]) );
+			svg.render( &painter, QRectF(i * size, 0, size, size) );
+		}
 	}
-};
 
-class QueenWidget : public PieceWidget, public Queen {
-public:
-	QueenWidget(int color, QWidget *parent=0) : PieceWidget(parent), Queen(color) {
-		if (color == Piece::WHITE) load( QString("img/wq.svg") );
-		else load( QString("img/bq.svg") );
+	void draw(QPainter& painter, const QPoint& pos, int tile) const {
+		if (tile < 0) return;
+		painter.drawPixmap( pos, mPixmap, QRect(tile * mSize, 0, mSize, mSize) );
 	}
-};
 
-class KingWidget : public PieceWidget, public King {
-public:
-	KingWidget(int color, QWidget *parent=0) : PieceWidget(parent), King(color) {
-		if (color == Piece::WHITE) load( QString("img/wk.svg") );
-		else load( QString("img/bk.svg") );
+	// Tile of a FEN piece letter.
+	static int tile(char letter) {
+		static const char letters[] = "PNBRQKpnbrqk";
+		const char *p = (letter != 0) ? strchr(letters, letter) : nullptr;
+		return (p == nullptr) ? -1 : (int) (p - letters);
 	}
 };
 
-class SquareWidget : public QSvgWidget {
-	PieceWidget *mPiece;
-
-public:
-	enum { BLACK = 0, WHITE = 1 };
-
-	SquareWidget(int color, QWidget *parent=0) : QSvgWidget(parent) {
-		mPiece = nullptr;
-		if (color == WHITE) load( QString("img/sq_w.svg") );
-		else if (color == BLACK) load( QString("img/sq_b.svg") );
-	}
-	
-	PieceWidget *replacePiece(PieceWidget *piece) {
-		if (piece != nullptr) piece->QWidget::move( pos() );
-		PieceWidget *copy = mPiece;
-		mPiece = piece;
-		return copy;
-	}
-	
-	PieceWidget *piece() { return mPiece; }
-	static int switchColor(int color) { return WHITE ^ BLACK ^ color; }
-};
-
-class BoardWidget : public QWidget, public Board {
+// Holds no rules of its own: the position comes from the server's "fen"
+// messages and the squares a piece may move to from its "legal" message.
+// A move is shown as soon as it is dropped and kept in mPending until the
+// server echoes it; if the server rejects it instead, the board goes back to
+// the last FEN it sent. Moves dropped during the opponent's turn queue up in
+// mPremoves and are shown made on the board; each "your turn" sends the next
+// one if the new "legal" masks allow it, and drops the whole queue if not.
+//
+// The whole board is painted by this one widget from mBoard; every change
+// repaints only the squares it touches.
+//
+// The arrow keys, Home and End step through the game: the board then shows
+// the position the server sends back for mViewPly, and End returns to the
+// game in progress.
+//
+// Every two seconds the client pings the server with its own monotonic time
+// and keeps a smoothed round-trip time, and an estimate of how far the
+// server's clock is ahead of mClock taken from the probes whose round trip
+// was no slower than usual.
+class BoardWidget : public QWidget {
 	Q_OBJECT;
 	int				mSquareSize;
-	SquareWidget*	mSquares[8][8];
-	PieceWidget*	mActivePiece;
-	SquareWidget*	mStartingSquare;
+	PieceAtlas		mAtlas;
+	char			mBoard[64];
+	bool			mDragging;
 	QPoint			mStartingPoint;
-	Chess			mChess;
+	QPoint			mDragPos;
+	quint64			mTargets[64];
+	QByteArray		mPosition;
+	QQueue<QByteArray>	mPending;
+	QQueue< QPair<QPoint, QPoint> >	mPremoves;
+	int				mColour;
+	int				mViewPly;
 	QTcpSocket*		mSocket;
-	QString			mLastMove;
+	FrameDecoder	mDecoder;
+	QElapsedTimer	mClock;
+	qint64			mRtt;
+	qint64			mClockOffset;
 
 public:
-	BoardWidget(QWidget *parent=0) : QWidget(parent), Board() {
-		mActivePiece = nullptr;
-		mStartingSquare = nullptr;
+	BoardWidget(QWidget *parent=0) : QWidget(parent) {
+		mSquareSize = 0;
+		mDragging = false;
+		mColour = -1;
+		mViewPly = -1;
+		mRtt = -1;
+		mClockOffset = 0;
+		memset(mBoard, 0, sizeof mBoard);
+		clearTargets();
+		setAttribute(Qt::WA_OpaquePaintEvent);
+		setFocusPolicy(Qt::StrongFocus);
 		setSize();
-		setSquares();
-		setPieces();
+		mPosition = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+		setPosition( mPosition.constData() );
 		mSocket = new QTcpSocket();
-		mSocket->connectToHost("127.0.0.1", 3000);
+		mSocket->connectToHost("127.0.0.1", s_default_port);
 		connect(mSocket, SIGNAL(readyRead()), this, SLOT(listener()));
+		mClock.start();
+		QTimer *timer = new QTimer(this);
+		connect(timer, SIGNAL(timeout()), this, SLOT(ping()));
+		timer->start(2000);
 	}
-	
+
 	void setSize() {
 		QRect rect = QApplication::desktop()->availableGeometry();
 		QPoint center = rect.center();
 		int boardSize = ( rect.width() < rect.height() ) ? rect.width() : rect.height();
 		boardSize = (int) (boardSize * 0.65);
-		mSquareSize = boardSize / 8;
-		boardSize = mSquareSize * 8;
+		boardSize = boardSize / 8 * 8;
 		rect.setSize( QSize(boardSize, boardSize) );
 		rect.moveCenter(center);
 		setGeometry(rect);
 	}
-	
-	void setSquares() {
-		QSize squareSize(mSquareSize, mSquareSize);
-		QPoint pos(0, 0);
-		int color = SquareWidget::WHITE;
-		for (int i = 0; i < 8; i++) {
-			for (int j = 0; j < 8; j++) {
-				SquareWidget *square = new SquareWidget(color, this);
-				square->resize(squareSize);
-				square->move(pos);
-				mSquares[i][j] = square;
-				color = SquareWidget::switchColor(color);
-				pos.rx() += mSquareSize;
+
+	// Places the pieces of the placement field of a FEN record.
+	void setPosition(const char *fen) {
+		int i = 0, j = 0;
+		for (const char *p = fen; *p != '\0' && *p != ' ' && i < 8; ++p) {
+			if (*p == '/') {
+				for (; j < 8; ++j) setPiece(i * 8 + j, 0);
+				++i;
+				j = 0;
+			} else if ('1' <= *p && *p <= '8') {
+				for (int n = *p - '0'; n > 0 && j < 8; --n, ++j) setPiece(i * 8 + j, 0);
+			} else if (j < 8) {
+				setPiece(i * 8 + j++, *p);
 			}
-			color = SquareWidget::switchColor(color);
-			pos.rx() = 0;
-			pos.ry() += mSquareSize;
 		}
+		for (; i < 8; ++i, j = 0)
+			for (; j < 8; ++j) setPiece(i * 8 + j, 0);
 	}
-	
-	void setPieces() {
-		QSize size(mSquareSize, mSquareSize);
-		Board::clear();
 
-		#define NEW_W_PIECE(_class, _i, _j) { \
-			_class *_p = new _class (Piece::WHITE, this); \
-			_p->resize(size); \
-			mSquares[_i][_j]->replacePiece(_p); \
-			set_piece(_p, Point(_i, _j)); \
+	// Reads "legal <square>:<mask> ...", where bit i * 8 + j of a mask is
+	// the square in row i from the top and column j.
+	void setLegal(const char *legal) {
+		clearTargets();
+		for (const char *p = strchr(legal, ' '); p != nullptr; p = strchr(p + 1, ' ')) {
+			int j = p[1] - 'a', i = 7 - (p[2] - '1');
+			if (i < 0 || i > 7 || j < 0 || j > 7 || p[3] != ':') continue;
+			mTargets[i * 8 + j] = QByteArray(p + 4, 16).toULongLong(nullptr, 16);
 		}
+	}
 
-		#define NEW_B_PIECE(_class, _i, _j) { \
-			_class *_p = new _class (Piece::BLACK, this); \
-			_p->resize(size); \
-			mSquares[_i][_j]->replacePiece(_p); \
-			set_piece(_p, Point(_i, _j)); \
+	virtual void resizeEvent(QResizeEvent *ev) {
+		QSize size = ev->size();
+		mSquareSize = ( size.width() < size.height() ? size.width() : size.height() ) / 8;
+		mAtlas.render(mSquareSize);
+		update();
+	}
+
+	virtual void paintEvent(QPaintEvent *ev) {
+		QPainter painter(this);
+		painter.fillRect( ev->rect(), palette().window() );
+		quint64 targets = mDragging ? mTargets[index(mStartingPoint)] : 0;
+		quint64 premoves = premoveSquares();
+		for (int i = 0; i < 64; ++i) {
+			QPoint square(i % 8, i / 8);
+			QRect rect = squareRect(square);
+			if ( !ev->rect().intersects(rect) ) continue;
+			mAtlas.draw( painter, rect.topLeft(), ( (i / 8 + i % 8) & 1 ) ? PieceAtlas::DARK_SQUARE : PieceAtlas::LIGHT_SQUARE );
+			if (premoves >> i & 1)
+				painter.fillRect( rect, QColor(200, 40, 40, 90) );
+			if ( !(mDragging && square == mStartingPoint) )
+				mAtlas.draw( painter, rect.topLeft(), PieceAtlas::tile(mBoard[i]) );
+			if (targets >> i & 1) {
+				painter.setRenderHint(QPainter::Antialiasing);
+				painter.setPen(Qt::NoPen);
+				painter.setBrush( QColor(0, 0, 0, 60) );
+				int r = mSquareSize / 6;
+				painter.drawEllipse(rect.center(), r, r);
+			}
 		}
+		if (mDragging)
+			mAtlas.draw( painter, dragRect().topLeft(), PieceAtlas::tile(mBoard[index(mStartingPoint)]) );
+	}
 
-		int i, j;
-		i = 6;
-		for (j = 0; j < 8; ++j)
-			NEW_W_PIECE(PawnWidget, i, j);
-		NEW_W_PIECE(RookWidget, 7, 0);
-		NEW_W_PIECE(RookWidget, 7, 7);
-		NEW_W_PIECE(KnightWidget, 7, 1);
-		NEW_W_PIECE(KnightWidget, 7, 6);
-		NEW_W_PIECE(BishopWidget, 7, 2);
-		NEW_W_PIECE(BishopWidget, 7, 5);
-		NEW_W_PIECE(QueenWidget, 7, 3);
-		NEW_W_PIECE(KingWidget, 7, 4);
-		
-		i = 1;
-		for (j = 0; j < 8; ++j)
-			NEW_B_PIECE(PawnWidget, i, j);
-		NEW_B_PIECE(RookWidget, 0, 0);
-		NEW_B_PIECE(RookWidget, 0, 7);
-		NEW_B_PIECE(KnightWidget, 0, 1);
-		NEW_B_PIECE(KnightWidget, 0, 6);
-		NEW_B_PIECE(BishopWidget, 0, 2);
-		NEW_B_PIECE(BishopWidget, 0, 5);
-		NEW_B_PIECE(QueenWidget, 0, 3);
-		NEW_B_PIECE(KingWidget, 0, 4);
-
-		mChess.setup(this);
-	}
-	
 	virtual void mousePressEvent(QMouseEvent *ev) {
+		if (ev->button() == Qt::RightButton) {
+			clearPremoves();
+			return;
+		}
+		if (mSquareSize == 0 || mViewPly >= 0) return;
 		QPoint pos(ev->pos().x() / mSquareSize, ev->pos().y() / mSquareSize);
-		SquareWidget *square = mSquares[pos.y()][pos.x()];
-		PieceWidget *piece = square->piece();
-		if (piece == nullptr) return;
-		piece->raise();
-		mActivePiece = piece;
+		if ( !onBoard(pos) ) return;
+		char piece = mBoard[index(pos)];
+		quint64 targets = mTargets[index(pos)];
+		if (piece == 0) return;
+		if ( targets == 0 && (myTurn() || !ownPiece(piece)) ) return;
+		mDragging = true;
 		mStartingPoint = pos;
-		mStartingSquare = square;
+		mDragPos = ev->pos();
+		updateSquares( targets | (quint64) 1 << index(pos) );
+		update( dragRect() );
 	}
-	
+
 	virtual void mouseMoveEvent(QMouseEvent *ev) {
-		if (mActivePiece != nullptr) mActivePiece->moveCenter( ev->pos() );
+		if (!mDragging) return;
+		update( dragRect() );
+		mDragPos = ev->pos();
+		update( dragRect() );
 	}
-	
+
 	virtual void mouseReleaseEvent(QMouseEvent *ev) {
-		if (mActivePiece == nullptr) return;
+		if (!mDragging) return;
 		QPoint endPoint(ev->pos().x() / mSquareSize, ev->pos().y() / mSquareSize);
-		const char *move = formMove(mStartingPoint, endPoint);
-		/*int status = mChess.enter_move(move);
-		if (status < 0) {
-			cout << status << endl;
-			mStartingSquare->replacePiece( mStartingSquare->piece() );
-		}*/
-		send(move);
-		mActivePiece = nullptr;
-	}
-	
-	virtual Piece *move_piece(const Point& p1, const Point& p2) {
-		SquareWidget *start = mSquares[p1.x()][p1.y()];
-		SquareWidget *end = mSquares[p2.x()][p2.y()];
-		end->replacePiece( start->replacePiece(nullptr) );
-		return Board::move_piece(p1, p2);
-	}
-
-	virtual Piece *set_piece(Piece *piece, const Point& pos) {
-		if (piece == NULL)
-			mSquares[pos.x()][pos.y()]->replacePiece(nullptr);
-		return Board::set_piece(piece, pos);
-	}
-	
-	static const char *formMove(const QPoint& start, const QPoint& end) {
+		bool turn = myTurn();
+		mDragging = false;
+		update( dragRect() );
+		updateSquares( mTargets[index(mStartingPoint)] | (quint64) 1 << index(mStartingPoint) );
+		if ( !onBoard(endPoint) || endPoint == mStartingPoint ) return;
+		if (!turn) {
+			mPremoves.enqueue( qMakePair(mStartingPoint, endPoint) );
+			movePiece(mStartingPoint, endPoint);
+			updateSquares( premoveSquares() );
+			return;
+		}
+		if ( legal(mStartingPoint, endPoint) ) play(mStartingPoint, endPoint);
+	}
+
+	virtual void keyPressEvent(QKeyEvent *ev) {
+		int live = livePly();
+		int ply = (mViewPly < 0) ? live : mViewPly;
+		switch ( ev->key() ) {
+			case Qt::Key_Left: --ply; break;
+			case Qt::Key_Right: ++ply; break;
+			case Qt::Key_Home: ply = 0; break;
+			case Qt::Key_End: ply = live; break;
+			default:
+				QWidget::keyPressEvent(ev);
+				return;
+		}
+		if (ply < 0) ply = 0;
+		if (ply >= live) {
+			mViewPly = -1;
+			if ( mPending.isEmpty() ) showPosition();
+			return;
+		}
+		mViewPly = ply;
+		send( (s_prefix_replay + std::to_string(ply)).c_str() );
+	}
+
+	static const char *formMove(char piece, const QPoint& start, const QPoint& end) {
 		static const char *castlingRight = "O-O";
 		static const char *castlingLeft = "O-O-O";
 		static char move[6];
-		
-		if ( start.x() == 4 && (start.y() == 0 || start.y() == 7) ) {
+
+		if ( (piece | 0x20) == 'k' ) {
 			QPoint d = end - start;
 			if (d.y() == 0) {
 				if (d.x() == 2) return castlingRight;
@@ -250,27 +282,227 @@ public:
 		}
 		pointToString(start, move);
 		pointToString(end, move + 2);
-		move[4] = '\0';
+		move[4] = ( (piece | 0x20) == 'p' && (end.y() == 0 || end.y() == 7) ) ? 'q' : '\0';
+		move[5] = '\0';
 		return move;
 	}
-	
+
 	static void pointToString(const QPoint& point, char *str) {
 		str[0] = (char) point.x() + 'a';
 		str[1] = (char) (7 - point.y()) + '1';
 	}
 
 public slots:
+	// Drains everything the socket has buffered and handles each complete
+	// message in order; a partial one waits in mDecoder for the next read.
 	void listener() {
-		char response[64];
-		mSocket->readLine(response, 64);
-		cout << "response " << response << endl;
-		if ( mChess.enter_move(response) < 0) {
-			if (mStartingSquare != nullptr) mStartingSquare->replacePiece( mStartingSquare->piece() );
+		char data[4096];
+		qint64 size;
+		while ( (size = mSocket->read(data, sizeof data)) > 0 ) mDecoder.feed(data, size);
+		std::string message;
+		while ( mDecoder.next(message) ) receive( message.c_str() );
+	}
+
+	void ping() {
+		send( (s_prefix_ping + std::to_string( now() )).c_str() );
+	}
+
+	void receive(const char *message) {
+		if ( has_prefix(message, s_prefix_ping) ) {
+			send( (s_prefix_pong + std::string(message + strlen(s_prefix_ping)) + " " + std::to_string( now() )).c_str() );
+		} else if ( has_prefix(message, s_prefix_pong) ) {
+			onPong(message + strlen(s_prefix_pong));
+		} else if ( has_prefix(message, s_prefix_fen) ) {
+			mPosition = message + strlen(s_prefix_fen);
+			if ( mPending.isEmpty() && mViewPly < 0 ) showPosition();
+		} else if ( has_prefix(message, s_prefix_replay) ) {
+			const char *fen = strchr(message + strlen(s_prefix_replay), ' ');
+			if ( fen != nullptr && mViewPly == atoi(message + strlen(s_prefix_replay)) ) setPosition(fen + 1);
+		} else if ( has_prefix(message, s_prefix_legal) ) {
+			learnColour();
+			setLegal(message);
+		} else if (strcmp(message, s_msg_your_turn) == 0) {
+			learnColour();
+			if ( !mPremoves.isEmpty() && mPending.isEmpty() ) playPremove();
+		} else if (strcmp(message, s_msg_invalid_move) == 0 || strcmp(message, s_msg_not_your_turn) == 0) {
+			rollback();
+		} else if (strcmp(message, s_msg_setup) == 0) {
+			mColour = -1;
+		} else if ( has_prefix(message, s_prefix_game_over) ) {
+			mColour = -1;
+			clearTargets();
+			clearPremoves();
+			rollback();
+		} else if ( !mPending.isEmpty() && mPending.head() == message ) {
+			mPending.dequeue();
 		}
 	}
-	
+
 	void send(const char *request) {
-		mSocket->write(request);
+		mSocket->write(request, strlen(request) + 1);
+	}
+
+public:
+	qint64 rtt() const { return mRtt; }
+	// Server monotonic time in microseconds at the client's time t.
+	qint64 serverTime(qint64 t) const { return t + mClockOffset; }
+
+private:
+	qint64 now() const { return mClock.nsecsElapsed() / 1000; }
+
+	// "pong <sent> <server time>" answering our ping.
+	void onPong(const char *args) {
+		char *end;
+		qint64 sent = strtoll(args, &end, 10);
+		qint64 server = strtoll(end, nullptr, 10);
+		qint64 received = now();
+		qint64 sample = received - sent;
+		if (sample < 0) return;
+		bool first = (mRtt < 0);
+		qint64 offset = server + sample / 2 - received;
+		if (first) mClockOffset = offset;
+		else if (sample <= mRtt + mRtt / 2) mClockOffset += (offset - mClockOffset) / 4;
+		mRtt = first ? sample : mRtt + (sample - mRtt) / 8;
+		setWindowTitle( QString("chess - %1 ms").arg(mRtt / 1000.0, 0, 'f', 1) );
+	}
+
+	// Shows the move at once and sends it; the server's echo confirms it.
+	void play(const QPoint& start, const QPoint& end) {
+		if (mViewPly >= 0) {
+			mViewPly = -1;
+			setPosition( mPosition.constData() );
+		}
+		char piece = mBoard[index(start)];
+		QByteArray move = formMove(piece, start, end);
+		mPending.enqueue(move);
+		clearTargets();
+		send( move.constData() );
+		movePiece(start, end);
+	}
+
+	// Sends the first premove if it is legal now and shows the rest made
+	// after it; the rest were planned on it, so if it is not they all go.
+	void playPremove() {
+		updateSquares( premoveSquares() );
+		QPair<QPoint, QPoint> premove = mPremoves.dequeue();
+		if ( !legal(premove.first, premove.second) ) {
+			mPremoves.clear();
+			if (mViewPly < 0) setPosition( mPosition.constData() );
+			return;
+		}
+		setPosition( mPosition.constData() );
+		play(premove.first, premove.second);
+		for (int i = 0; i < mPremoves.size(); ++i) movePiece(mPremoves[i].first, mPremoves[i].second);
+	}
+
+	// Moves the piece on start to end on the board alone.
+	void movePiece(const QPoint& start, const QPoint& end) {
+		char piece = mBoard[index(start)];
+		if (piece == 0) return;
+		// Castling is the king dropped on its own rook, as Chess960 masks
+		// have it, or moved two files; either way the king ends on the g or
+		// c file and the rook next to it, wherever they started.
+		bool king = (piece | 0x20) == 'k';
+		bool onRook = king && mBoard[index(end)] == (piece == 'K' ? 'R' : 'r');
+		if ( king && end.y() == start.y() && (onRook || end.x() - start.x() == 2 || start.x() - end.x() == 2) ) {
+			bool kingside = end.x() > start.x();
+			QPoint rook = onRook ? end : QPoint(kingside ? 7 : 0, start.y());
+			char rookPiece = mBoard[index(rook)];
+			setPiece(index(rook), 0);
+			setPiece(index(start), 0);
+			setPiece( index( QPoint(kingside ? 5 : 3, start.y()) ), rookPiece );
+			setPiece( index( QPoint(kingside ? 6 : 2, start.y()) ), piece );
+			return;
+		}
+		setPiece(index(end), piece);
+		setPiece(index(start), 0);
+	}
+
+	void rollback() {
+		mPending.clear();
+		if (mViewPly < 0) showPosition();
+	}
+
+	// Plies played so far, from the move counters of the last FEN.
+	int livePly() const {
+		QList<QByteArray> fields = mPosition.split(' ');
+		if (fields.size() < 6) return 0;
+		return (fields[5].toInt() - 1) * 2 + (fields[1] == "b" ? 1 : 0);
+	}
+
+	// The last FEN with the premoves made on it.
+	void showPosition() {
+		setPosition( mPosition.constData() );
+		for (int i = 0; i < mPremoves.size(); ++i) movePiece(mPremoves[i].first, mPremoves[i].second);
+	}
+
+	// A move of ours still waiting for its echo is on the board too, so the
+	// premoves are taken back by the FEN that follows the echo.
+	void clearPremoves() {
+		if ( mPremoves.isEmpty() ) return;
+		updateSquares( premoveSquares() );
+		mPremoves.clear();
+		if ( mPending.isEmpty() && mViewPly < 0 ) setPosition( mPosition.constData() );
+	}
+
+	quint64 premoveSquares() const {
+		quint64 squares = 0;
+		for (int i = 0; i < mPremoves.size(); ++i)
+			squares |= (quint64) 1 << index(mPremoves[i].first) | (quint64) 1 << index(mPremoves[i].second);
+		return squares;
+	}
+
+	bool legal(const QPoint& start, const QPoint& end) const {
+		return mTargets[index(start)] >> index(end) & 1;
+	}
+
+	bool myTurn() const {
+		for (int i = 0; i < 64; ++i)
+			if (mTargets[i] != 0) return true;
+		return false;
+	}
+
+	// "legal" and "your turn" only ever go to the side to move, so the first
+	// of them in a game tells us our colour; until then nothing is ours.
+	void learnColour() {
+		if (mColour >= 0) return;
+		int space = mPosition.indexOf(' ');
+		mColour = (space < 0 || mPosition.at(space + 1) == 'w') ? 1 : 0;
+	}
+
+	bool ownPiece(char piece) const {
+		if (mColour < 0) return false;
+		bool white = ('A' <= piece && piece <= 'Z');
+		return white == (mColour == 1);
+	}
+
+	void setPiece(int i, char piece) {
+		if (mBoard[i] == piece) return;
+		mBoard[i] = piece;
+		update( squareRect( QPoint(i % 8, i / 8) ) );
+	}
+
+	void updateSquares(quint64 squares) {
+		for (int i = 0; i < 64; ++i)
+			if (squares >> i & 1) update( squareRect( QPoint(i % 8, i / 8) ) );
+	}
+
+	QRect squareRect(const QPoint& pos) const {
+		return QRect(pos.x() * mSquareSize, pos.y() * mSquareSize, mSquareSize, mSquareSize);
+	}
+
+	QRect dragRect() const {
+		return QRect(mDragPos.x() - mSquareSize / 2, mDragPos.y() - mSquareSize / 2, mSquareSize, mSquareSize);
+	}
+
+	void clearTargets() {
+		for (int i = 0; i < 64; ++i) mTargets[i] = 0;
+	}
+
+	static int index(const QPoint& pos) { return pos.y() * 8 + pos.x(); }
+
+	static bool onBoard(const QPoint& pos) {
+		return 0 <= pos.x() && pos.x() < 8 && 0 <= pos.y() && pos.y() < 8;
 	}
 };
 
@@ -0,0 +1,441 @@
+#ifndef ARCHIVE_HPP
+#define ARCHIVE_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "chess.hpp"
+#include "move_cache.hpp"
+
+using namespace std;
+
+// Same values as PgnGame::result(), with UNKNOWN stored as 3.
+enum { ARCHIVE_BLACK_WINS = 0, ARCHIVE_DRAW = 1, ARCHIVE_WHITE_WINS = 2, ARCHIVE_UNKNOWN = 3 };
+
+// A finished game as the archive stores it: each move is its index in
+// Chess::legal_moves() of the position it was played in.
+struct ArchivedGame {
+	static const int s_opening_plies = 8;
+	vector<uint8_t>	moves;
+	uint64_t		opening;	// Chess::hash() after s_opening_plies, or at the end if shorter
+	uint32_t		date;		// seconds since the epoch
+	uint8_t			result;
+	string			white;
+	string			black;
+
+	ArchivedGame() { opening = 0; date = 0; result = ARCHIVE_UNKNOWN; }
+
+	// Sets moves and opening from a game played from the starting position,
+	// looking the legal moves up in cache if given. Returns false at the
+	// first move that is not legal.
+	bool encode(const Move *played, int n, MoveCache *cache = NULL) {
+		Chess chess;
+		chess.setup();
+		moves.clear();
+		opening = chess.hash();
+		LegalMoves legal;
+		for (int i = 0; i < n; ++i) {
+			generate(chess, legal, cache);
+			int index = find(legal, played[i]);
+			if (index < 0) return false;
+			moves.push_back( (uint8_t) index );
+			chess.enter_move(legal.moves[index]);
+			if (i < s_opening_plies) opening = chess.hash();
+		}
+		return true;
+	}
+
+	// The inverse of encode(): the moves, played from the starting position.
+	static bool decode(const uint8_t *indices, int n, vector<Move>& played, MoveCache *cache = NULL) {
+		Chess chess;
+		chess.setup();
+		played.clear();
+		LegalMoves legal;
+		for (int i = 0; i < n; ++i) {
+			generate(chess, legal, cache);
+			if (indices[i] >= legal.count) return false;
+			played.push_back(legal.moves[ indices[i] ]);
+			chess.enter_move(legal.moves[ indices[i] ]);
+		}
+		return true;
+	}
+
+private:
+	static void generate(Chess& chess, LegalMoves& legal, MoveCache *cache) {
+		if (cache != NULL) cache->get(chess, legal);
+		else legal.count = chess.legal_moves(legal.moves);
+	}
+
+	// The engine accepts a promotion suffix on any move and ignores it, so
+	// a move that is not listed as played falls back to its squares.
+	static int find(const LegalMoves& legal, const Move& move) {
+		for (int i = 0; i < legal.count; ++i) if (legal.moves[i] == move) return i;
+		for (int i = 0; i < legal.count; ++i)
+			if ( (legal.moves[i].kind() == Move::NORMAL || legal.moves[i].kind() == Move::CASTLING) &&
+					legal.moves[i].from() == move.from() && legal.moves[i].to() == move.to() ) return i;
+		return -1;
+	}
+};
+
+// An archive file is s_archive_magic followed by blocks of up to
+// ArchiveWriter::s_block_games games. Each block is this header and one
+// column per field, so a scan reads only the columns it needs and skips
+// whole blocks by size.
+struct ArchiveBlockHeader {
+	enum { RESULTS, PLIES, DATES, OPENINGS, WHITE, BLACK, FREQUENCIES, MOVES, COLUMNS };
+	char		magic[4];
+	uint32_t	games;
+	uint64_t	first_game;		// id of the block's first game
+	uint64_t	plies;
+	uint32_t	size;			// bytes of columns after the header
+	uint32_t	columns[COLUMNS];	// offset of each column after the header
+};
+
+static const char s_archive_magic[8] = { 'C', 'H', 'A', 'R', 'C', '1', '\0', '\0' };
+static const char s_archive_block_magic[4] = { 'B', 'L', 'K', '1' };
+
+// The moves of a block are one rANS stream over all its games, coded with
+// the block's own frequencies of each legal-move index.
+class ArchiveCoder {
+public:
+	static const int s_prob_bits = 12;
+	static const uint32_t s_total = 1 << s_prob_bits;
+	static const uint32_t s_low = 1 << 23;
+
+	// Scales counts to frequencies that sum to s_total, keeping every
+	// symbol that occurs at one or more.
+	static void normalize(const uint64_t *counts, uint16_t *freq) {
+		uint64_t total = 0;
+		for (int s = 0; s < 256; ++s) total += counts[s];
+		uint32_t sum = 0;
+		for (int s = 0; s < 256; ++s) {
+			freq[s] = (counts[s] == 0) ? 0 : (uint16_t) max<uint64_t>(1, counts[s] * s_total / total);
+			sum += freq[s];
+		}
+		if (total == 0) return;
+		while (sum != s_total) {
+			int best = -1;
+			for (int s = 0; s < 256; ++s)
+				if ( freq[s] > (sum > s_total ? 1 : 0) && (best < 0 || freq[s] > freq[best]) ) best = s;
+			if (sum > s_total) {
+				--freq[best];
+				--sum;
+			} else {
+				++freq[best];
+				++sum;
+			}
+		}
+	}
+
+	static void encode(const uint8_t *symbols, size_t n, const uint16_t *freq, vector<uint8_t>& out) {
+		uint32_t cum[256];
+		cumulate(freq, cum);
+		vector<uint8_t> stack;
+		uint32_t x = s_low;
+		for (size_t i = n; i-- > 0; ) {
+			uint32_t f = freq[ symbols[i] ];
+			uint32_t limit = ( (s_low >> s_prob_bits) << 8 ) * f;
+			while (x >= limit) {
+				stack.push_back( (uint8_t) x );
+				x >>= 8;
+			}
+			x = ( (x / f) << s_prob_bits ) + (x % f) + cum[ symbols[i] ];
+		}
+		for (int i = 0; i < 4; ++i) {
+			stack.push_back( (uint8_t) x );
+			x >>= 8;
+		}
+		out.insert( out.end(), stack.rbegin(), stack.rend() );
+	}
+
+	static void cumulate(const uint16_t *freq, uint32_t *cum) {
+		uint32_t c = 0;
+		for (int s = 0; s < 256; ++s) {
+			cum[s] = c;
+			c += freq[s];
+		}
+	}
+};
+
+// Decodes the move stream of one block, symbol by symbol.
+class ArchiveMoveReader {
+	uint16_t		m_freq[256];
+	uint32_t		m_cum[256];
+	uint8_t			m_symbols[ArchiveCoder::s_total];
+	const uint8_t	*m_in;
+	uint32_t		m_x;
+
+public:
+	// freq holds the block's frequencies, in is its move column.
+	ArchiveMoveReader(const uint16_t *freq, const uint8_t *in) {
+		memcpy(m_freq, freq, sizeof m_freq);
+		ArchiveCoder::cumulate(m_freq, m_cum);
+		for (int s = 0; s < 256; ++s) memset(m_symbols + m_cum[s], s, m_freq[s]);
+		m_x = (uint32_t) in[0] << 24 | (uint32_t) in[1] << 16 | (uint32_t) in[2] << 8 | in[3];
+		m_in = in + 4;
+	}
+
+	uint8_t next() {
+		uint32_t slot = m_x & (ArchiveCoder::s_total - 1);
+		uint8_t s = m_symbols[slot];
+		m_x = m_freq[s] * (m_x >> ArchiveCoder::s_prob_bits) + slot - m_cum[s];
+		while (m_x < ArchiveCoder::s_low) m_x = (m_x << 8) | *m_in++;
+		return s;
+	}
+};
+
+// A read-only view of one block in a mapped archive.
+class ArchiveBlock {
+	const ArchiveBlockHeader	*m_header;
+	const uint8_t				*m_columns;
+
+public:
+	ArchiveBlock(const ArchiveBlockHeader *header) {
+		m_header = header;
+		m_columns = reinterpret_cast<const uint8_t*>(header + 1);
+	}
+
+	uint32_t games() const { return m_header->games; }
+	uint64_t first_game() const { return m_header->first_game; }
+	uint64_t plies() const { return m_header->plies; }
+	const uint8_t *results() const { return column<uint8_t>(ArchiveBlockHeader::RESULTS); }
+	const uint16_t *ply_counts() const { return column<uint16_t>(ArchiveBlockHeader::PLIES); }
+	const uint32_t *dates() const { return column<uint32_t>(ArchiveBlockHeader::DATES); }
+	const uint64_t *openings() const { return column<uint64_t>(ArchiveBlockHeader::OPENINGS); }
+	// Size of the coded moves alone, padding included.
+	uint32_t move_bytes() const { return m_header->size - m_header->columns[ArchiveBlockHeader::MOVES]; }
+	string white(uint32_t i) const { return name(ArchiveBlockHeader::WHITE, i); }
+	string black(uint32_t i) const { return name(ArchiveBlockHeader::BLACK, i); }
+
+	ArchiveMoveReader moves() const {
+		return ArchiveMoveReader( column<uint16_t>(ArchiveBlockHeader::FREQUENCIES),
+			column<uint8_t>(ArchiveBlockHeader::MOVES) );
+	}
+
+	// The move indices of game i, decoding the block's stream up to it.
+	void game_moves(uint32_t i, vector<uint8_t>& indices) const {
+		ArchiveMoveReader reader = moves();
+		const uint16_t *plies = ply_counts();
+		for (uint32_t g = 0; g < i; ++g)
+			for (int p = 0; p < plies[g]; ++p) reader.next();
+		indices.resize(plies[i]);
+		for (int p = 0; p < plies[i]; ++p) indices[p] = reader.next();
+	}
+
+private:
+	template <class T> const T *column(int c) const {
+		return reinterpret_cast<const T*>(m_columns + m_header->columns[c]);
+	}
+
+	string name(int c, uint32_t i) const {
+		const uint32_t *offsets = column<uint32_t>(c);
+		const char *text = reinterpret_cast<const char*>(offsets + m_header->games + 1);
+		return string(text + offsets[i], text + offsets[i + 1]);
+	}
+};
+
+// A mapped archive file. Blocks are walked with first() and next(); a
+// block that was cut short by a crash ends the walk.
+class Archive {
+	const char	*m_data;
+	size_t		m_size;
+
+public:
+	Archive() { m_data = NULL; m_size = 0; }
+	~Archive() { close(); }
+
+	bool open(const char *path) {
+		close();
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof s_archive_magic) {
+			::close(fd);
+			return false;
+		}
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (map == MAP_FAILED) return false;
+		if (memcmp(map, s_archive_magic, sizeof s_archive_magic) != 0) {
+			munmap(map, st.st_size);
+			return false;
+		}
+		m_data = static_cast<const char*>(map);
+		m_size = st.st_size;
+		return true;
+	}
+
+	void close() {
+		if (m_data != NULL) munmap(const_cast<char*>(m_data), m_size);
+		m_data = NULL;
+		m_size = 0;
+	}
+
+	const ArchiveBlockHeader *first() const { return at(sizeof s_archive_magic); }
+
+	const ArchiveBlockHeader *next(const ArchiveBlockHeader *block) const {
+		return at( reinterpret_cast<const char*>(block + 1) + block->size - m_data );
+	}
+
+	// The block holding game id, found by skipping whole blocks.
+	const ArchiveBlockHeader *find(uint64_t id) const {
+		for (const ArchiveBlockHeader *b = first(); b != NULL; b = next(b))
+			if (id < b->first_game + b->games) return (id >= b->first_game) ? b : NULL;
+		return NULL;
+	}
+
+	size_t size() const { return m_size; }
+
+	// Offset just past the last whole block.
+	size_t end() const {
+		size_t offset = sizeof s_archive_magic;
+		for (const ArchiveBlockHeader *b = first(); b != NULL; b = next(b))
+			offset = reinterpret_cast<const char*>(b + 1) + b->size - m_data;
+		return offset;
+	}
+
+private:
+	const ArchiveBlockHeader *at(size_t offset) const {
+		if ( m_data == NULL || offset + sizeof(ArchiveBlockHeader) > m_size ) return NULL;
+		const ArchiveBlockHeader *block = reinterpret_cast<const ArchiveBlockHeader*>(m_data + offset);
+		if ( memcmp(block->magic, s_archive_block_magic, sizeof block->magic) != 0 ||
+				offset + sizeof(ArchiveBlockHeader) + block->size > m_size ) return NULL;
+		return block;
+	}
+};
+
+// Appends games to an archive file a block at a time. Games wait in memory
+// until s_block_games of them fill a block or flush() is called.
+class ArchiveWriter {
+	FILE					*m_out;
+	vector<ArchivedGame>	m_games;
+	uint64_t				m_next_game;
+
+public:
+	static const uint32_t s_block_games = 1024;
+
+	ArchiveWriter() { m_out = NULL; m_next_game = 0; }
+	~ArchiveWriter() { close(); }
+
+	// New blocks go right after the last whole one: a block torn by a crash
+	// is cut off first, since readers stop at it. A file that is not an
+	// archive is left alone.
+	bool open(const char *path) {
+		close();
+		Archive archive;
+		m_next_game = 0;
+		size_t end = 0;
+		if ( archive.open(path) ) {
+			for (const ArchiveBlockHeader *b = archive.first(); b != NULL; b = archive.next(b))
+				m_next_game = b->first_game + b->games;
+			end = archive.end();
+			archive.close();
+		}
+		m_out = fopen(path, "ab");
+		if (m_out == NULL) return false;
+		if ( (end == 0 && ftell(m_out) >= (long) sizeof s_archive_magic) || ftruncate(fileno(m_out), end) != 0 ) {
+			fclose(m_out);
+			m_out = NULL;
+			return false;
+		}
+		if (end == 0) {
+			fwrite(s_archive_magic, sizeof s_archive_magic, 1, m_out);
+			fflush(m_out);
+		}
+		return true;
+	}
+
+	void close() {
+		if (m_out == NULL) return;
+		flush();
+		fclose(m_out);
+		m_out = NULL;
+	}
+
+	bool is_open() const { return m_out != NULL; }
+
+	// Returns the id the game will have in the archive.
+	uint64_t add(const ArchivedGame& game) {
+		m_games.push_back(game);
+		if (m_games.size() >= s_block_games) flush();
+		return m_next_game + m_games.size() - 1;
+	}
+
+	void flush() {
+		if ( m_out == NULL || m_games.empty() ) return;
+		ArchiveBlockHeader header;
+		memset(&header, 0, sizeof header);
+		memcpy(header.magic, s_archive_block_magic, sizeof header.magic);
+		header.games = (uint32_t) m_games.size();
+		header.first_game = m_next_game;
+
+		vector<uint8_t> columns, symbols;
+		uint64_t counts[256] = { 0 };
+		for (size_t i = 0; i < m_games.size(); ++i) {
+			const vector<uint8_t>& moves = m_games[i].moves;
+			for (size_t p = 0; p < moves.size(); ++p) ++counts[ moves[p] ];
+			symbols.insert( symbols.end(), moves.begin(), moves.end() );
+		}
+		header.plies = symbols.size();
+
+		begin_column(header, ArchiveBlockHeader::RESULTS, columns);
+		for (size_t i = 0; i < m_games.size(); ++i) columns.push_back(m_games[i].result);
+		begin_column(header, ArchiveBlockHeader::PLIES, columns);
+		for (size_t i = 0; i < m_games.size(); ++i) append<uint16_t>(columns, (uint16_t) m_games[i].moves.size());
+		begin_column(header, ArchiveBlockHeader::DATES, columns);
+		for (size_t i = 0; i < m_games.size(); ++i) append<uint32_t>(columns, m_games[i].date);
+		begin_column(header, ArchiveBlockHeader::OPENINGS, columns);
+		for (size_t i = 0; i < m_games.size(); ++i) append<uint64_t>(columns, m_games[i].opening);
+		append_names(header, ArchiveBlockHeader::WHITE, &ArchivedGame::white, columns);
+		append_names(header, ArchiveBlockHeader::BLACK, &ArchivedGame::black, columns);
+		uint16_t freq[256];
+		ArchiveCoder::normalize(counts, freq);
+		begin_column(header, ArchiveBlockHeader::FREQUENCIES, columns);
+		for (int s = 0; s < 256; ++s) append<uint16_t>(columns, freq[s]);
+		begin_column(header, ArchiveBlockHeader::MOVES, columns);
+		ArchiveCoder::encode(symbols.data(), symbols.size(), freq, columns);
+		while (columns.size() % 8 != 0) columns.push_back(0);
+		header.size = (uint32_t) columns.size();
+
+		fwrite(&header, sizeof header, 1, m_out);
+		fwrite(columns.data(), 1, columns.size(), m_out);
+		fflush(m_out);
+		m_next_game += m_games.size();
+		m_games.clear();
+	}
+
+private:
+	// Columns start 8-byte aligned so the reader can use them in place.
+	static void begin_column(ArchiveBlockHeader& header, int c, vector<uint8_t>& columns) {
+		while (columns.size() % 8 != 0) columns.push_back(0);
+		header.columns[c] = (uint32_t) columns.size();
+	}
+
+	template <class T> static void append(vector<uint8_t>& columns, T value) {
+		const uint8_t *p = reinterpret_cast<const uint8_t*>(&value);
+		columns.insert(columns.end(), p, p + sizeof value);
+	}
+
+	// games + 1 offsets into the text that follows them.
+	void append_names(ArchiveBlockHeader& header, int c, string ArchivedGame::*field, vector<uint8_t>& columns) {
+		begin_column(header, c, columns);
+		uint32_t offset = 0;
+		append<uint32_t>(columns, 0);
+		for (size_t i = 0; i < m_games.size(); ++i) {
+			offset += (uint32_t) (m_games[i].*field).size();
+			append<uint32_t>(columns, offset);
+		}
+		for (size_t i = 0; i < m_games.size(); ++i) {
+			const string& name = m_games[i].*field;
+			columns.insert( columns.end(), name.begin(), name.end() );
+		}
+	}
+};
+
+#endif
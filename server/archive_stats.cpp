@@ -0,0 +1,133 @@
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "archive.hpp"
+
+using namespace std;
+
+static const char *s_results[] = { "0-1", "1/2-1/2", "1-0", "*" };
+
+struct Opening {
+	uint64_t	key;
+	uint64_t	games;
+	uint64_t	points;		// half points scored by white, over games with a result
+	uint64_t	decided;
+	uint64_t	example;	// id of a game that reached it
+};
+
+// Counts from the result and ply columns only; no moves are decoded.
+static void summary(const Archive& archive) {
+	uint64_t blocks = 0, games = 0, plies = 0, move_bytes = 0, results[4] = { 0 };
+	for (const ArchiveBlockHeader *b = archive.first(); b != NULL; b = archive.next(b)) {
+		ArchiveBlock block(b);
+		++blocks;
+		games += block.games();
+		plies += block.plies();
+		move_bytes += block.move_bytes();
+		for (uint32_t i = 0; i < block.games(); ++i) ++results[ min<uint8_t>(block.results()[i], ARCHIVE_UNKNOWN) ];
+	}
+	printf("%llu blocks, %llu games, %llu plies, %zu bytes, %.2f bits/ply, %.2f of them moves\n",
+		(unsigned long long) blocks, (unsigned long long) games, (unsigned long long) plies, archive.size(),
+		plies > 0 ? archive.size() * 8.0 / plies : 0.0, plies > 0 ? move_bytes * 8.0 / plies : 0.0);
+	for (int r = ARCHIVE_WHITE_WINS; r >= ARCHIVE_BLACK_WINS; --r)
+		printf("%s\t%llu\n", s_results[r], (unsigned long long) results[r]);
+	printf("%s\t%llu\n", s_results[ARCHIVE_UNKNOWN], (unsigned long long) results[ARCHIVE_UNKNOWN]);
+}
+
+static void print_moves(const vector<Move>& moves, size_t n) {
+	for (size_t p = 0; p < n && p < moves.size(); ++p) {
+		char move[8];
+		moves[p].to_string(move);
+		printf("%s%s", p > 0 ? " " : "", move);
+	}
+	printf("\n");
+}
+
+// The most common positions after ArchivedGame::s_opening_plies, from the
+// opening column, each with the moves of one game that reached it.
+static void openings(const Archive& archive, size_t top) {
+	unordered_map<uint64_t, Opening> counts;
+	for (const ArchiveBlockHeader *b = archive.first(); b != NULL; b = archive.next(b)) {
+		ArchiveBlock block(b);
+		for (uint32_t i = 0; i < block.games(); ++i) {
+			Opening& o = counts[ block.openings()[i] ];
+			if (o.games++ == 0) {
+				o.key = block.openings()[i];
+				o.example = block.first_game() + i;
+			}
+			if (block.results()[i] != ARCHIVE_UNKNOWN) {
+				o.points += block.results()[i];
+				++o.decided;
+			}
+		}
+	}
+	vector<Opening> sorted;
+	for (unordered_map<uint64_t, Opening>::iterator it = counts.begin(); it != counts.end(); ++it)
+		sorted.push_back(it->second);
+	sort( sorted.begin(), sorted.end(), [](const Opening& a, const Opening& b) { return a.games > b.games; } );
+	printf("games\twhite\tkey\t\t\tmoves\n");
+	for (size_t i = 0; i < top && i < sorted.size(); ++i) {
+		const Opening& o = sorted[i];
+		const ArchiveBlockHeader *b = archive.find(o.example);
+		vector<uint8_t> indices;
+		vector<Move> moves;
+		ArchiveBlock(b).game_moves(o.example - b->first_game, indices);
+		ArchivedGame::decode( indices.data(), (int) indices.size(), moves );
+		printf("%llu\t", (unsigned long long) o.games);
+		if (o.decided > 0) printf("%.1f%%", o.points * 50.0 / o.decided);
+		else printf("-");
+		printf("\t%016llx\t", (unsigned long long) o.key);
+		print_moves(moves, ArchivedGame::s_opening_plies);
+	}
+}
+
+static bool print_game(const Archive& archive, uint64_t id) {
+	const ArchiveBlockHeader *b = archive.find(id);
+	if (b == NULL) return false;
+	ArchiveBlock block(b);
+	uint32_t i = (uint32_t) (id - block.first_game());
+	vector<uint8_t> indices;
+	vector<Move> moves;
+	block.game_moves(i, indices);
+	if ( !ArchivedGame::decode( indices.data(), (int) indices.size(), moves ) ) return false;
+	time_t date = block.dates()[i];
+	char day[16];
+	strftime(day, sizeof day, "%Y.%m.%d", gmtime(&date));
+	printf( "%s - %s\t%s\t%s\n", block.white(i).c_str(), block.black(i).c_str(), day,
+		s_results[ min<uint8_t>(block.results()[i], ARCHIVE_UNKNOWN) ] );
+	print_moves( moves, moves.size() );
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	size_t top = 0;
+	int64_t id = -1;
+	int opt;
+	while ( (opt = getopt(argc, argv, "o:g:")) != -1 ) {
+		if (opt == 'o') top = atoi(optarg);
+		else if (opt == 'g') id = atoll(optarg);
+		else break;
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-o top] [-g game] games.arc\n", argv[0]);
+		return 1;
+	}
+	Archive archive;
+	if ( !archive.open(argv[optind]) ) {
+		fprintf(stderr, "%s: not an archive\n", argv[optind]);
+		return 1;
+	}
+	if (id >= 0) {
+		if ( print_game(archive, id) ) return 0;
+		fprintf(stderr, "%lld: no such game\n", (long long) id);
+		return 1;
+	}
+	if (top > 0) openings(archive, top);
+	else summary(archive);
+	return 0;
+}
@@ -0,0 +1,286 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <cstdint>
+#include <vector>
+#include "chess.hpp"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define BATCH_AVX2 1
+#endif
+
+using namespace std;
+
+// The generic kernel returns vectors only into validate_avx2(), where it is
+// inlined, so GCC's note about the AVX return ABI does not apply. It is
+// reported when the translation unit ends, so it stays off from here on.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// Validates many (position, move) pairs at once. Positions are laid out as
+// one column of bitboards per field and checked with branch-free bit
+// arithmetic, LANES at a time with AVX2 where the CPU has it and one at a
+// time otherwise. A move passes if Chess::enter_move would take it from
+// that position, either at once or pending a promotion piece; one that
+// passes may be entered with the king-safety check skipped.
+class MoveBatch {
+public:
+	enum { LANES = 4 };
+
+	MoveBatch() { m_size = 0; }
+
+	// Empties the batch and makes room for count pairs, so that add()
+	// writes each one in place.
+	void reset(int count) {
+		size_t blocks = (count + LANES - 1) / LANES;
+		if (m_blocks.size() < blocks) m_blocks.resize(blocks);
+		m_size = 0;
+	}
+
+	// Returns the slot of the pair; at most the count given to reset() may
+	// be added. The position must not be waiting for a promotion piece.
+	int add(const Chess::Packed& position, const Move& move) {
+		uint64_t ranks[8];
+		boards(position.squares, ranks);
+		int turn = position.turn, i = m_size++;
+		uint64_t own = ranks[turn], their = ranks[1 - turn];
+		at(OWN, i) = own;
+		at(THEIR, i) = their;
+		for (int c = PAWNS; c <= KINGS; ++c) at(c, i) = ranks[c];
+		at(EN_PASSANT, i) = (position.en_passant >= 0) ?
+			1ULL << ((turn == Chess::WHITE ? 16 : 40) + position.en_passant) : 0;
+		at(FROM, i) = move.from().index();
+		at(TO, i) = move.to().index();
+		at(TURN, i) = turn;
+		at(KING, i) = __builtin_ctzll(own & ranks[KINGS]);
+		at(CASTLING, i) = (move.kind() == Move::CASTLING) ? (move.to().y() > move.from().y() ? 1 : 2) : 0;
+		at(RIGHTS, i) = position.castling;
+		return i;
+	}
+
+	// Sets legal[slot] to 1 for each pair that passes and to 0 otherwise.
+	void validate(uint8_t *legal) {
+		int n = m_size;
+		int i = 0;
+#ifdef BATCH_AVX2
+		if ( __builtin_cpu_supports("avx2") )
+			for (; i + LANES <= n; i += LANES) validate_avx2(i, legal);
+#endif
+		for (; i < n; ++i) legal[i] = validate_scalar(i);
+		for (i = 0; i < n; ++i) if (at(CASTLING, i) != 0) legal[i] = castle(i);
+	}
+
+	int size() const { return m_size; }
+
+private:
+	enum { OWN, THEIR, PAWNS, KNIGHTS, DIAGONAL, ORTHOGONAL, KINGS, EN_PASSANT, FROM, TO, TURN, KING,
+			CASTLING, RIGHTS, COLUMNS };
+	// LANES pairs to a block, so that a pair's row is written to one place
+	// and each column of a block is read in one load.
+	struct Block {
+		uint64_t	columns[COLUMNS][LANES];
+	};
+	vector<Block>		m_blocks;
+	int					m_size;
+
+	struct Tables {
+		uint64_t	knight[64];
+		uint64_t	king[64];
+		uint64_t	pawn[128];		// captures, by turn * 64 + square
+		uint64_t	diagonal[64];
+		uint64_t	orthogonal[64];
+		uint64_t	between[64 * 64];
+		uint64_t	squares[256];	// by byte of Packed::squares, see add()
+
+		Tables() {
+			for (int i = 0; i < 64; ++i) {
+				Point from(i / 8, i % 8);
+				knight[i] = targets(from, s_knight_moves, 8, 1);
+				king[i] = targets(from, s_king_moves, 8, 1);
+				pawn[Chess::WHITE * 64 + i] = targets(from, s_white_pawn_captures, 2, 1);
+				pawn[Chess::BLACK * 64 + i] = targets(from, s_black_pawn_captures, 2, 1);
+				diagonal[i] = targets(from, s_bishop_moves, 4, 7);
+				orthogonal[i] = targets(from, s_rook_moves, 4, 7);
+				for (int j = 0; j < 64; ++j) between[i * 64 + j] = 0;
+				for (int d = 0; d < 8; ++d) {
+					const Point& step = (d < 4) ? s_bishop_moves[d] : s_rook_moves[d - 4];
+					uint64_t ray = 0;
+					for (Point p = from + step; p.in_range(); p += step) {
+						between[i * 64 + p.index()] = ray;
+						ray |= 1ULL << p.index();
+					}
+				}
+			}
+			// Byte BLACK or WHITE of an entry marks the pieces of that colour
+			// and byte PAWNS to KINGS those of the column, with bit 0 for the
+			// low nibble's square and bit 1 for the high one's.
+			for (int i = 0; i < 256; ++i) {
+				squares[i] = 0;
+				for (int half = 0; half < 2; ++half) {
+					int code = (i >> (4 * half)) & 15;
+					if (code == 0 || code > 12) continue;
+					static const int columns[6][2] = { { PAWNS, PAWNS }, { KNIGHTS, KNIGHTS }, { DIAGONAL, DIAGONAL },
+						{ ORTHOGONAL, ORTHOGONAL }, { DIAGONAL, ORTHOGONAL }, { KINGS, KINGS } };
+					const int *column = columns[(code - 1) >> 1];
+					squares[i] |= ( (1ULL << (8 * ((code - 1) & 1))) | (1ULL << (8 * column[0])) |
+						(1ULL << (8 * column[1])) ) << half;
+				}
+			}
+		}
+
+		static uint64_t targets(const Point& from, const Point *steps, int count, int range) {
+			uint64_t bits = 0;
+			for (int i = 0; i < count; ++i) {
+				Point p = from + steps[i];
+				for (int n = 0; n < range && p.in_range(); ++n, p += steps[i]) bits |= 1ULL << p.index();
+			}
+			return bits;
+		}
+	};
+
+	static const Tables& tables() {
+		static const Tables s_tables;
+		return s_tables;
+	}
+
+	// Fills ranks[BLACK], ranks[WHITE] and ranks[PAWNS] to ranks[KINGS] with
+	// the bitboards of squares: one word per rank with a byte per column of
+	// its squares, turned into one word per column with a byte per rank.
+	static void boards(const uint8_t *squares, uint64_t *ranks) {
+		const Tables& t = tables();
+		for (int r = 0; r < 8; ++r) {
+			const uint8_t *s = squares + 4 * r;
+			ranks[r] = t.squares[s[0]] | t.squares[s[1]] << 2 | t.squares[s[2]] << 4 | t.squares[s[3]] << 6;
+		}
+		swap_bytes<32>(ranks[0], ranks[4]);
+		swap_bytes<32>(ranks[1], ranks[5]);
+		swap_bytes<32>(ranks[2], ranks[6]);
+		swap_bytes<32>(ranks[3], ranks[7]);
+		swap_bytes<16>(ranks[0], ranks[2]);
+		swap_bytes<16>(ranks[1], ranks[3]);
+		swap_bytes<16>(ranks[4], ranks[6]);
+		swap_bytes<16>(ranks[5], ranks[7]);
+		swap_bytes<8>(ranks[0], ranks[1]);
+		swap_bytes<8>(ranks[2], ranks[3]);
+		swap_bytes<8>(ranks[4], ranks[5]);
+		swap_bytes<8>(ranks[6], ranks[7]);
+	}
+
+	// Exchanges the high S bits of each 2 * S in a with the low S bits of
+	// the same in b.
+	template <int S> static inline __attribute__((always_inline)) void swap_bytes(uint64_t& a, uint64_t& b) {
+		static const uint64_t mask = ~0ULL / ( (1ULL << S) + 1 );
+		uint64_t t = ( (a >> S) ^ b ) & mask;
+		b ^= t;
+		a ^= t << S;
+	}
+
+	uint64_t& at(int column, int i) { return m_blocks[i / LANES].columns[column][i % LANES]; }
+	uint64_t at(int column, int i) const { return m_blocks[i / LANES].columns[column][i % LANES]; }
+
+	uint8_t validate_scalar(int i) const {
+		return kernel<uint64_t>( tables(), at(OWN, i), at(THEIR, i), at(PAWNS, i), at(KNIGHTS, i), at(DIAGONAL, i),
+			at(ORTHOGONAL, i), at(KINGS, i), at(EN_PASSANT, i), at(FROM, i), at(TO, i), at(TURN, i), at(KING, i) ) != 0;
+	}
+
+	// Castling goes through the same rules as Chess::can_castle: the right,
+	// an empty path between king and rook, and no attack on the squares the
+	// king stands on, crosses or reaches.
+	uint8_t castle(int i) const {
+		const Tables& t = tables();
+		uint64_t own = at(OWN, i), their = at(THEIR, i);
+		int turn = (int) at(TURN, i), side = (int) at(CASTLING, i);
+		int rank = (turn == Chess::WHITE) ? 56 : 0;
+		int right = (side == Chess::CASTLING_KINGSIDE ? 1 : 2) << (turn == Chess::WHITE ? 0 : 2);
+		if ( !(at(RIGHTS, i) & right) || at(KING, i) != (uint64_t) rank + 4 ) return 0;
+		int rook = rank + (side == Chess::CASTLING_KINGSIDE ? 7 : 0);
+		if ( t.between[(rank + 4) * 64 + rook] & (own | their) ) return 0;
+		int step = (side == Chess::CASTLING_KINGSIDE) ? 1 : -1;
+		for (int sq = rank + 4; sq != rank + 4 + 3 * step; sq += step)
+			if ( attacked<uint64_t>(t, sq, own, their, at(PAWNS, i), at(KNIGHTS, i),
+					at(DIAGONAL, i), at(ORTHOGONAL, i), at(KINGS, i), turn) ) return 0;
+		return 1;
+	}
+
+	static uint64_t nonzero(uint64_t x) { return (x != 0) ? ~0ULL : 0; }
+	static uint64_t bit(uint64_t i) { return 1ULL << i; }
+	static uint64_t gather(const uint64_t *table, uint64_t i) { return table[i]; }
+
+	template <int L, int R, class V> static inline __attribute__((always_inline)) V shift(const V& b) { return L ? (b << L) : (b >> R); }
+
+	template <class V> static inline __attribute__((always_inline)) V select(const V& mask, const V& a, const V& b) { return (a & mask) | (b & ~mask); }
+
+	// Squares reached from gen by sliding one way over empty squares.
+	template <int L, int R, class V> static inline __attribute__((always_inline)) V slide(const V& from, const V& empty, uint64_t wrap) {
+		V gen = from, pro = empty & wrap;
+		gen |= pro & shift<L, R>(gen);
+		pro &= shift<L, R>(pro);
+		gen |= pro & shift<2 * L, 2 * R>(gen);
+		pro &= shift<2 * L, 2 * R>(pro);
+		gen |= pro & shift<4 * L, 4 * R>(gen);
+		return shift<L, R>(gen) & wrap;
+	}
+
+	// Enemy pieces of their attacking square sq.
+	template <class V> static inline __attribute__((always_inline)) V attacked(const Tables& t, const V& sq, const V& own, const V& their,
+			const V& pawns, const V& knights, const V& diagonal, const V& orthogonal, const V& kings, const V& turn) {
+		static const uint64_t not_a = ~0x0101010101010101ULL, not_h = ~0x8080808080808080ULL;
+		V b = bit(sq), empty = ~(own | their);
+		V attackers = gather(t.knight, sq) & knights;
+		attackers |= gather(t.king, sq) & kings;
+		attackers |= gather(t.pawn, turn * 64 + sq) & pawns;
+		V diagonals = slide<9, 0>(b, empty, not_a) | slide<7, 0>(b, empty, not_h) |
+			slide<0, 7>(b, empty, not_a) | slide<0, 9>(b, empty, not_h);
+		V lines = slide<1, 0>(b, empty, not_a) | slide<0, 1>(b, empty, not_h) |
+			slide<8, 0>(b, empty, ~0ULL) | slide<0, 8>(b, empty, ~0ULL);
+		attackers |= (diagonals & diagonal) | (lines & orthogonal);
+		return attackers & their;
+	}
+
+	// All ones in each lane whose move is pseudo-legal and leaves its own
+	// king safe.
+	template <class V> static inline __attribute__((always_inline)) V kernel(const Tables& t, const V& own,
+			const V& their, const V& pawns, const V& knights, const V& diagonal, const V& orthogonal, const V& kings,
+			const V& en_passant, const V& from, const V& to, const V& turn, const V& king) {
+		V f = bit(from), b = bit(to), occupied = own | their;
+		V white = 0 - turn;
+		V forward = select<V>(white, f >> 8, f << 8);
+		V jump = select<V>(white, (f & 0x00FF000000000000ULL) >> 16, (f & 0x000000000000FF00ULL) << 16);
+		V blocked = select<V>(white, occupied >> 8, occupied << 8);
+		V pawn = (forward & ~occupied) | (jump & ~occupied & ~blocked) |
+			( gather(t.pawn, turn * 64 + from) & (their | en_passant) );
+		V reach = pawn & nonzero(pawns & f);
+		reach |= gather(t.knight, from) & nonzero(knights & f);
+		reach |= gather(t.king, from) & nonzero(kings & f);
+		V line = ( gather(t.diagonal, from) & nonzero(diagonal & f) ) |
+			( gather(t.orthogonal, from) & nonzero(orthogonal & f) );
+		reach |= line & ~nonzero(gather(t.between, from * 64 + to) & occupied);
+		V ok = nonzero(own & f) & ~nonzero(own & b) & nonzero(reach & b);
+
+		V captured = select<V>( nonzero(pawns & f) & nonzero(en_passant & b), select<V>(white, b << 8, b >> 8), turn & 0 );
+		V own_after = (own & ~f) | b, their_after = their & ~b & ~captured;
+		V square = select<V>(nonzero(kings & f), to, king);
+		return ok & ~nonzero( attacked(t, square, own_after, their_after, pawns, knights, diagonal, orthogonal,
+			kings, turn) );
+	}
+
+#ifdef BATCH_AVX2
+	typedef uint64_t u64x4 __attribute__((vector_size(32)));
+
+	__attribute__((target("avx2"))) static u64x4 nonzero(u64x4 x) { return (u64x4) (x != 0); }
+	__attribute__((target("avx2"))) static u64x4 bit(u64x4 i) { return (u64x4) { 1, 1, 1, 1 } << i; }
+	__attribute__((target("avx2"))) static u64x4 gather(const uint64_t *table, u64x4 i) {
+		return (u64x4) _mm256_i64gather_epi64( (const long long*) table, (__m256i) i, 8 );
+	}
+
+	__attribute__((target("avx2"), flatten)) void validate_avx2(int i, uint8_t *legal) const {
+		u64x4 c[COLUMNS];
+		for (int k = 0; k < COLUMNS; ++k) c[k] = (u64x4) _mm256_loadu_si256( (const __m256i*) m_blocks[i / LANES].columns[k] );
+		u64x4 ok = kernel<u64x4>( tables(), c[OWN], c[THEIR], c[PAWNS], c[KNIGHTS], c[DIAGONAL], c[ORTHOGONAL],
+			c[KINGS], c[EN_PASSANT], c[FROM], c[TO], c[TURN], c[KING] );
+		for (int k = 0; k < LANES; ++k) legal[i + k] = ok[k] != 0;
+	}
+#endif
+};
+
+#endif
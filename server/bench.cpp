@@ -0,0 +1,312 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+#include "batch.hpp"
+#include "chess.hpp"
+#include "history.hpp"
+#include "move_cache.hpp"
+
+using namespace std;
+
+static uint64_t s_allocations = 0;
+
+void *operator new(size_t size) {
+	++s_allocations;
+	void *p = malloc(size ? size : 1);
+	if (p == NULL) throw bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static volatile int s_sink;
+
+static const char *s_ruy_lopez[] = {
+	"e4", "e5", "Nf3", "Nc6", "Bb5", "a6", "Ba4", "Nf6", "O-O", "Be7",
+	"Re1", "b5", "Bb3", "d6", "c3", "O-O", "h3", "Nb8", "d4", "Nbd7", NULL
+};
+
+static const char *s_najdorf[] = {
+	"e4", "c5", "Nf3", "d6", "d4", "cxd4", "Nxd4", "Nf6", "Nc3", "a6",
+	"Be3", "e5", "Nb3", "Be6", "f3", "Be7", "Qd2", "O-O", "O-O-O", "Nbd7",
+	"g4", "b5", "g5", "b4", "Ne2", "Ne8", "f4", "a5", "f5", NULL
+};
+
+static const char *s_scholar[] = { "e4", "f5", "Qh5+", NULL };
+
+static int replay(Chess& chess, const char **moves, int plies = 1000) {
+	chess.setup();
+	int n = 0;
+	for (; moves[n] != NULL && n < plies; ++n)
+		if (chess.enter_san(moves[n]) != Chess::ACCEPTED) abort();
+	return n;
+}
+
+static void setup_endgame(Chess& chess) {
+	Board *board = new Board();
+	board->clear();
+	board->set( Point("g1"), new King(Piece::WHITE) );
+	board->set( Point("d1"), new Rook(Piece::WHITE) );
+	board->set( Point("e4"), new Pawn(Piece::WHITE) );
+	board->set( Point("f2"), new Pawn(Piece::WHITE) );
+	board->set( Point("g8"), new King(Piece::BLACK) );
+	board->set( Point("a7"), new Rook(Piece::BLACK) );
+	board->set( Point("f7"), new Pawn(Piece::BLACK) );
+	chess.setup(board, Chess::WHITE);
+}
+
+// Runs fn in batches until min_time has passed, five times, and reports the
+// median batch in ns and allocations per op.
+template <class Fn>
+static void run(const char *name, int ops_per_call, Fn fn) {
+	typedef chrono::steady_clock Clock;
+	const double min_time = 0.05;
+	long calls = 1;
+	for (;;) {
+		Clock::time_point start = Clock::now();
+		for (long i = 0; i < calls; ++i) fn();
+		if (chrono::duration<double>(Clock::now() - start).count() >= min_time) break;
+		calls *= 2;
+	}
+	double samples[5];
+	uint64_t allocations = 0;
+	for (int r = 0; r < 5; ++r) {
+		uint64_t before = s_allocations;
+		Clock::time_point start = Clock::now();
+		for (long i = 0; i < calls; ++i) fn();
+		double ns = chrono::duration<double, nano>(Clock::now() - start).count();
+		allocations = s_allocations - before;
+		samples[r] = ns / ( (double) calls * ops_per_call );
+	}
+	sort(samples, samples + 5);
+	printf( "%s\t%.1f\t%.2f\n", name, samples[2], (double) allocations / ( (double) calls * ops_per_call ) );
+}
+
+static int count_targets(Chess& chess) {
+	int n = 0;
+	const Board& board = chess.board();
+	for (int i = 0; i < 64; ++i) {
+		Piece *piece = board.get( Point(i / 8, i % 8) );
+		if (piece == NULL || piece->color() != chess.turn()) continue;
+		n += 63;
+	}
+	return n;
+}
+
+static void bench_position(const char *name, Chess& chess) {
+	string prefix(name);
+	const Board& board = chess.board();
+	int targets = count_targets(chess);
+
+	run( (prefix + "/valid_move").c_str(), targets, [&]() {
+		int s = 0;
+		for (int i = 0; i < 64; ++i) {
+			Piece *piece = board.get( Point(i / 8, i % 8) );
+			if (piece == NULL || piece->color() != chess.turn()) continue;
+			for (int j = 0; j < 64; ++j)
+				if (i != j) s += piece->valid_move( Point(j / 8, j % 8), &board );
+		}
+		s_sink = s;
+	} );
+
+	run( (prefix + "/check").c_str(), targets, [&]() {
+		int s = 0;
+		for (int i = 0; i < 64; ++i) {
+			Piece *piece = board.get( Point(i / 8, i % 8) );
+			if (piece == NULL || piece->color() != chess.turn()) continue;
+			for (int j = 0; j < 64; ++j)
+				if (i != j) s += chess.check( Point(i / 8, i % 8), Point(j / 8, j % 8) );
+		}
+		s_sink = s;
+	} );
+
+	run( (prefix + "/under_attack").c_str(), 128, [&]() {
+		int s = 0;
+		for (int i = 0; i < 64; ++i) {
+			s += chess.under_attack( Point(i / 8, i % 8), Piece::WHITE );
+			s += chess.under_attack( Point(i / 8, i % 8), Piece::BLACK );
+		}
+		s_sink = s;
+	} );
+
+	// The same pairs as check, through validate() one by one and through a
+	// MoveBatch filled from the packed position.
+	run( (prefix + "/validate").c_str(), targets, [&]() {
+		int s = 0;
+		for (int i = 0; i < 64; ++i) {
+			Piece *piece = board.get( Point(i / 8, i % 8) );
+			if (piece == NULL || piece->color() != chess.turn()) continue;
+			for (int j = 0; j < 64; ++j)
+				if (i != j) s += chess.validate( Point(i / 8, i % 8), Point(j / 8, j % 8) ) > 0;
+		}
+		s_sink = s;
+	} );
+
+	Chess::Packed packed;
+	chess.pack(packed);
+	MoveBatch batch;
+	vector<uint8_t> legal(targets);
+	run( (prefix + "/batch_validate").c_str(), targets, [&]() {
+		batch.reset(targets);
+		for (int i = 0; i < 64; ++i) {
+			Piece *piece = board.get( Point(i / 8, i % 8) );
+			if (piece == NULL || piece->color() != chess.turn()) continue;
+			for (int j = 0; j < 64; ++j)
+				if (i != j) batch.add( packed, Move( Point(i / 8, i % 8), Point(j / 8, j % 8) ) );
+		}
+		batch.validate( legal.data() );
+		s_sink = legal[0];
+	} );
+
+	// What the server needs after each move, generated and from a cache
+	// that holds the position.
+	LegalMoves moves;
+	run( (prefix + "/legal_moves").c_str(), 1, [&]() {
+		moves.generate(chess);
+		s_sink = moves.count;
+	} );
+	MoveCache cache(1);
+	run( (prefix + "/move_cache_get").c_str(), 1, [&]() {
+		cache.get(chess, moves);
+		s_sink = moves.count;
+	} );
+
+	// Every from/to pair the engine rejects; rejected moves leave the position
+	// untouched, so this measures the validation path on its own.
+	vector<Move> rejected;
+	for (int i = 0; i < 64; ++i)
+		for (int j = 0; j < 64; ++j)
+			if ( i != j && chess.validate( Point(i / 8, i % 8), Point(j / 8, j % 8) ) <= 0 )
+				rejected.push_back( Move( Point(i / 8, i % 8), Point(j / 8, j % 8) ) );
+	run( (prefix + "/enter_move_rejected").c_str(), rejected.size(), [&]() {
+		int s = 0;
+		for (size_t i = 0; i < rejected.size(); ++i) s += chess.enter_move(rejected[i]);
+		s_sink = s;
+	} );
+}
+
+static void parse(const char **sans, vector<Move>& moves) {
+	Chess chess;
+	chess.setup();
+	for (int i = 0; sans[i] != NULL; ++i) {
+		Move move;
+		if (chess.parse_san(sans[i], move) != Chess::ACCEPTED) abort();
+		chess.enter_move(move);
+		moves.push_back(move);
+	}
+}
+
+// What Server::validate_moves does with a tick's moves, against what
+// accept_move does with a move the batch has not seen: the move each
+// position of both games was left by, its position packed as in the
+// GameRecord and loaded as after Game::load.
+static void bench_server() {
+	const char **games[] = { s_ruy_lopez, s_najdorf };
+	vector<Chess::Packed> positions;
+	vector<Move> moves;
+	vector<Chess*> engines;
+	for (int g = 0; g < 2; ++g) {
+		Chess chess;
+		chess.setup();
+		for (int i = 0; games[g][i] != NULL; ++i) {
+			Move move;
+			if (chess.parse_san(games[g][i], move) != Chess::ACCEPTED) abort();
+			positions.push_back( Chess::Packed() );
+			chess.pack( positions.back() );
+			moves.push_back(move);
+			engines.push_back( new Chess(chess) );
+			chess.enter_move(move);
+		}
+	}
+	int n = moves.size();
+
+	MoveBatch batch;
+	vector<uint8_t> legal(n);
+	run("server/batch_validate", n, [&]() {
+		batch.reset(n);
+		for (int i = 0; i < n; ++i) batch.add(positions[i], moves[i]);
+		batch.validate( legal.data() );
+		s_sink = legal[0];
+	} );
+
+	// Every position is in the cache, as it is once its moves have been
+	// sent to the player.
+	MoveCache cache(16);
+	LegalMoves cached;
+	run("server/move_cache_contains", n, [&]() {
+		int s = 0;
+		for (int i = 0; i < n; ++i) {
+			cache.get(*engines[i], cached);
+			s += cached.contains(moves[i]);
+		}
+		s_sink = s;
+	} );
+	for (int i = 0; i < n; ++i) delete engines[i];
+}
+
+int main() {
+	printf("benchmark\tns/op\tallocs/op\n");
+
+	Chess chess;
+	run("setup", 1, [&]() { chess.setup(); s_sink = chess.turn(); });
+
+	vector<Move> opening_moves, middlegame_moves;
+	parse(s_ruy_lopez, opening_moves);
+	parse(s_najdorf, middlegame_moves);
+	// Setup plus a whole game, per ply.
+	run("enter_move/opening_game", opening_moves.size(), [&]() {
+		chess.setup();
+		for (size_t i = 0; i < opening_moves.size(); ++i) chess.enter_move(opening_moves[i]);
+		s_sink = chess.turn();
+	});
+	run("enter_move/middlegame_game", middlegame_moves.size(), [&]() {
+		chess.setup();
+		for (size_t i = 0; i < middlegame_moves.size(); ++i) chess.enter_move(middlegame_moves[i]);
+		s_sink = chess.turn();
+	});
+	run("enter_san/middlegame_game", middlegame_moves.size(), [&]() {
+		chess.setup();
+		for (int i = 0; s_najdorf[i] != NULL; ++i) chess.enter_san(s_najdorf[i]);
+		s_sink = chess.turn();
+	});
+
+	// Every ply of a 288-ply game of knight moves, looked up from the history.
+	static const char *shuffle[] = { "g1f3", "g8f6", "f3g1", "f6g8" };
+	History history;
+	uint32_t last = History::ROOT;
+	chess.setup();
+	for (int i = 0; i < 288; ++i) {
+		Move move;
+		move.from_string(shuffle[i % 4], chess.turn());
+		chess.enter_move(move);
+		last = history.push(last, move, chess);
+	}
+	Chess position;
+	run("history/seek", history.depth(last) + 1, [&]() {
+		for (int ply = 0; ply <= history.depth(last); ++ply) history.position(last, ply, position);
+		s_sink = position.turn();
+	});
+
+	Chess opening, middlegame, endgame, checks;
+	replay(opening, s_ruy_lopez, 6);
+	replay(middlegame, s_najdorf);
+	setup_endgame(endgame);
+	replay(checks, s_scholar);
+
+	char fen[Chess::FEN_SIZE], out[Chess::FEN_SIZE];
+	middlegame.to_fen(fen);
+	run("fen/load", 1, [&]() { s_sink = chess.setup(fen); });
+	run("fen/save", 1, [&]() { s_sink = middlegame.to_fen(out); });
+
+	bench_position("opening", opening);
+	bench_position("middlegame", middlegame);
+	bench_position("endgame", endgame);
+	bench_position("checks", checks);
+	bench_server();
+	return 0;
+}
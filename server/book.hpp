@@ -0,0 +1,104 @@
+#ifndef BOOK_HPP
+#define BOOK_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include "chess.hpp"
+
+struct BookEntry {
+	uint64_t	key;
+	uint16_t	move;
+	uint16_t	weight;
+	uint32_t	count;
+};
+
+struct BookHeader {
+	char		magic[8];
+	uint64_t	size;
+};
+
+static const char s_book_magic[8] = { 'C', 'H', 'B', 'O', 'O', 'K', '1', '\0' };
+
+// Sorted by key, then by descending weight. The file is mapped as is, so
+// opening costs one mmap and a probe touches only the entries it compares.
+class Book {
+	const BookEntry	*m_entries;
+	uint64_t		m_size;
+	void			*m_map;
+	size_t			m_map_size;
+
+public:
+	Book() { m_entries = NULL; m_size = 0; m_map = NULL; m_map_size = 0; }
+	~Book() { close(); }
+
+	bool open(const char *path) {
+		close();
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(BookHeader)) {
+			::close(fd);
+			return false;
+		}
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (map == MAP_FAILED) return false;
+		const BookHeader *header = static_cast<const BookHeader*>(map);
+		if ( memcmp(header->magic, s_book_magic, sizeof s_book_magic) != 0 ||
+				sizeof(BookHeader) + header->size * sizeof(BookEntry) > (size_t) st.st_size ) {
+			munmap(map, st.st_size);
+			return false;
+		}
+		m_map = map;
+		m_map_size = st.st_size;
+		m_entries = reinterpret_cast<const BookEntry*>(header + 1);
+		m_size = header->size;
+		return true;
+	}
+
+	void close() {
+		if (m_map != NULL) munmap(m_map, m_map_size);
+		m_entries = NULL; m_size = 0; m_map = NULL; m_map_size = 0;
+	}
+
+	// Returns the number of entries for the key and points first at them.
+	int probe(uint64_t key, const BookEntry **first) const {
+		uint64_t lo = 0, hi = m_size;
+		// Keys are uniformly distributed hashes: interpolate while the range is
+		// large, then finish with a plain binary search.
+		while (hi - lo > 64) {
+			uint64_t klo = m_entries[lo].key, khi = m_entries[hi - 1].key;
+			if (key < klo || key > khi) return 0;
+			uint64_t mid = lo + (uint64_t) ( (long double) (key - klo) / ((long double) (khi - klo) + 1) * (hi - lo) );
+			if (m_entries[mid].key < key) lo = mid + 1;
+			else hi = mid + 1;
+			if (hi - lo > 64) {
+				uint64_t half = lo + (hi - lo) / 2;
+				if (m_entries[half].key < key) lo = half + 1;
+				else hi = half + 1;
+			}
+		}
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			if (m_entries[mid].key < key) lo = mid + 1;
+			else hi = mid;
+		}
+		int n = 0;
+		while (lo + n < m_size && m_entries[lo + n].key == key) ++n;
+		*first = m_entries + lo;
+		return n;
+	}
+
+	int probe(const Chess& chess, const BookEntry **first) const {
+		return probe(chess.hash(), first);
+	}
+
+	bool is_open() const { return m_map != NULL; }
+	uint64_t size() const { return m_size; }
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "chess.hpp"
+#include "pgn.hpp"
+#include "book.hpp"
+
+using namespace std;
+
+static bool by_key_move(const BookEntry& a, const BookEntry& b) {
+	return a.key != b.key ? a.key < b.key : a.move < b.move;
+}
+
+static bool by_key_weight(const BookEntry& a, const BookEntry& b) {
+	return a.key != b.key ? a.key < b.key : a.weight > b.weight;
+}
+
+class Collector {
+	Chess	m_chess;
+	int		m_depth;
+	int		m_result;
+	int		m_ply;
+
+public:
+	vector<BookEntry>	entries;
+
+	Collector(int depth) { m_depth = depth; }
+	Collector(const Collector& other) { m_depth = other.m_depth; }
+
+	void operator()(PgnGame& game) {
+		m_result = game.result();
+		if (m_result == PgnGame::UNKNOWN) return;
+		m_ply = 0;
+		pgn_replay(game, m_chess, *this);
+	}
+
+	bool operator()(const Chess& chess, const Move& move) {
+		if (m_ply++ >= m_depth) return false;
+		BookEntry entry;
+		entry.key = chess.hash();
+		entry.move = move.code();
+		entry.weight = (chess.turn() == Chess::WHITE) ? m_result : 2 - m_result;
+		entry.count = 1;
+		entries.push_back(entry);
+		return true;
+	}
+};
+
+int main(int argc, char *argv[]) {
+	int depth = 16;
+	unsigned min_games = 1;
+	int threads = thread::hardware_concurrency();
+	int opt;
+	while ( (opt = getopt(argc, argv, "d:n:j:")) != -1 ) {
+		if (opt == 'd') depth = atoi(optarg);
+		else if (opt == 'n') min_games = atoi(optarg);
+		else if (opt == 'j') threads = atoi(optarg);
+		else break;
+	}
+	if (argc - optind < 2) {
+		fprintf(stderr, "usage: %s [-d depth] [-n min_games] [-j threads] book.bin games.pgn...\n", argv[0]);
+		return 1;
+	}
+	if (threads < 1) threads = 1;
+
+	vector<BookEntry> entries;
+	for (int i = optind + 1; i < argc; ++i) {
+		PgnFile file;
+		if ( !file.open(argv[i]) ) {
+			fprintf(stderr, "%s: cannot open\n", argv[i]);
+			return 1;
+		}
+		vector<Collector> workers(threads, Collector(depth));
+		pgn_for_each_game(file.begin(), file.end(), workers);
+		for (size_t t = 0; t < workers.size(); ++t) {
+			entries.insert( entries.end(), workers[t].entries.begin(), workers[t].entries.end() );
+			vector<BookEntry>().swap(workers[t].entries);
+		}
+	}
+
+	sort(entries.begin(), entries.end(), by_key_move);
+	vector<uint64_t> scores;
+	size_t n = 0;
+	uint64_t max_score = 1;
+	for (size_t i = 0; i < entries.size(); ) {
+		BookEntry entry = entries[i];
+		uint64_t score = 0;
+		uint32_t count = 0;
+		for (; i < entries.size() && entries[i].key == entry.key && entries[i].move == entry.move; ++i) {
+			score += entries[i].weight;
+			++count;
+		}
+		if (count < min_games) continue;
+		entry.count = count;
+		entries[n++] = entry;
+		scores.push_back(score);
+		max_score = max(max_score, score);
+	}
+	entries.resize(n);
+	for (size_t i = 0; i < n; ++i) {
+		uint64_t weight = (max_score > 0xffff) ? scores[i] * 0xffff / max_score : scores[i];
+		entries[i].weight = (uint16_t) max<uint64_t>(weight, 1);
+	}
+	sort(entries.begin(), entries.end(), by_key_weight);
+
+	FILE *out = fopen(argv[optind], "wb");
+	if (out == NULL) {
+		fprintf(stderr, "%s: cannot create\n", argv[optind]);
+		return 1;
+	}
+	BookHeader header;
+	memcpy(header.magic, s_book_magic, sizeof header.magic);
+	header.size = entries.size();
+	fwrite(&header, sizeof header, 1, out);
+	if ( !entries.empty() ) fwrite(&entries[0], sizeof(BookEntry), entries.size(), out);
+	fclose(out);
+	printf("%zu entries\n", entries.size());
+	return 0;
+}
@@ -5,6 +5,11 @@
 #include <string>
 #include <vector>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <new>
+#include <algorithm>
 
 using namespace std;
 
@@ -13,21 +18,21 @@ class Point {
 	int m_y;
 public:
 	Point() {}
-	Point(int x, int y) { m_x = x; m_y = y; }
+	constexpr Point(int x, int y) : m_x(x), m_y(y) {}
 	Point(const char *str) { from_string(str); }
 	bool from_string(const char *str) {
 		m_x = (int) ( 7 - (str[1] - '1') );
 		m_y = (int) (str[0] - 'a');
 		return in_range(); 
 	}
-	char *to_string() const {
-		static char str[3]; str[2] = '\0';
+	void to_string(char *str) const {
 		str[0] = (char) m_y + 'a';
 		str[1] = (char) (7 - m_x) + '1';
-		return str;
+		str[2] = '\0';
 	}
-	int x() const { return m_x; }
-	int y() const { return m_y; }
+	constexpr int x() const { return m_x; }
+	constexpr int y() const { return m_y; }
+	constexpr int index() const { return m_x * 8 + m_y; }
 	bool in_range() const { return (0 <= m_x && m_x <= 7) && (0 <= m_y && m_y <= 7); }
 	int xabs() const { return m_x < 0 ? -m_x : m_x; }
 	int yabs() const { return m_y < 0 ? -m_y : m_y; }
@@ -72,6 +77,59 @@ public:
 
 class Board;
 
+class Move {
+	uint16_t m_code;
+public:
+	enum { NORMAL = 0, KNIGHT = 1, BISHOP = 2, ROOK = 3, QUEEN = 4, CASTLING = 5 };
+	Move() { m_code = 0; }
+	Move(const Point& from, const Point& to, int kind = NORMAL) {
+		m_code = (uint16_t) ( from.index() | (to.index() << 6) | (kind << 12) );
+	}
+	static Move from_code(uint16_t code) { Move move; move.m_code = code; return move; }
+	
+	bool from_string(const char *str, int turn) {
+		Point p1, p2;
+		if ( p1.from_string(str) && p2.from_string(str + 2) ) {
+			int kind = NORMAL;
+			switch (str[4]) {
+				case 'n': case 'N': kind = KNIGHT; break;
+				case 'b': case 'B': kind = BISHOP; break;
+				case 'r': case 'R': kind = ROOK; break;
+				case 'q': case 'Q': kind = QUEEN; break;
+			}
+			*this = Move(p1, p2, kind);
+			return true;
+		}
+		int rank = (turn == 1) ? 7 : 0;
+		if (strcmp(str, "O-O") == 0) {
+			*this = Move(Point(rank, 4), Point(rank, 6), CASTLING);
+			return true;
+		} else if (strcmp(str, "O-O-O") == 0) {
+			*this = Move(Point(rank, 4), Point(rank, 2), CASTLING);
+			return true;
+		}
+		return false;
+	}
+	
+	void to_string(char *str) const {
+		if (kind() == CASTLING) {
+			strcpy(str, to().y() > from().y() ? "O-O" : "O-O-O");
+			return;
+		}
+		static const char promotions[] = " nbrq";
+		from().to_string(str);
+		to().to_string(str + 2);
+		str[4] = (kind() == NORMAL) ? '\0' : promotions[kind()];
+		str[5] = '\0';
+	}
+	
+	Point from() const { return Point( (m_code >> 3) & 7, m_code & 7 ); }
+	Point to() const { return Point( (m_code >> 9) & 7, (m_code >> 6) & 7 ); }
+	int kind() const { return m_code >> 12; }
+	uint16_t code() const { return m_code; }
+	bool operator==(const Move& move) const { return m_code == move.m_code; }
+};
+
 class Piece {
 protected:
 	int		m_type;
@@ -85,7 +143,7 @@ public:
 	virtual ~Piece() {}
 	void set_pos(const Point& pos) { m_pos = pos; }
 	virtual void move(const Point& pos) { m_pos = pos; }
-	virtual int valid_move(const Point& pos, const Board *board)=0;
+	virtual int valid_move(const Point& pos, const Board *board) const = 0;
 	int color() const { return m_color; }
 	int type() const { return m_type; }
 	Point pos() const { return m_pos; }
@@ -121,8 +179,8 @@ public:
 	
 	Piece *get(const Point& pos) const {
 		Piece *piece = m_squares[pos.x()][pos.y()];
-		if (piece != NULL && piece->pos() != pos) cout << "Error\n";
-		return m_squares[pos.x()][pos.y()];
+		assert(piece == NULL || piece->pos() == pos);
+		return piece;
 	}
 	
 	Piece *set(const Point& pos, Piece *piece) {
@@ -144,7 +202,7 @@ public:
 		m_pos = pos;
 	}
 	
-	virtual int valid_move(const Point& point, const Board *board) {
+	virtual int valid_move(const Point& point, const Board *board) const {
 		Point d = point - m_pos;
 		int sign = (m_color == WHITE) ? -1 : 1;
 		int status;
@@ -166,7 +224,7 @@ public:
 			else if (m_color == BLACK && point.x() == 5)
 				piece = board->get(point + Point(-1, 0));
 			else return 0;
-			if (piece->type() == PAWN && static_cast<Pawn*>(piece)->m_en_passant)
+			if (piece != NULL && piece->type() == PAWN && static_cast<Pawn*>(piece)->m_en_passant)
 				return 3;
 			return 0;
 		}
@@ -174,13 +232,15 @@ public:
 	}
 	
 	bool en_passant(bool b) { return m_en_passant = b; }
+	bool moved() const { return m_moved; }
+	bool moved(bool b) { return m_moved = b; }
 };
 
 class Knight : public Piece {
 public:
 	Knight(int color) : Piece(KNIGHT, color) {}
 	
-	virtual int valid_move(const Point& point, const Board*) {
+	virtual int valid_move(const Point& point, const Board*) const {
 		Point d = (point - m_pos).abs();
 		return ( d.x() == 2 && d.y() == 1 ) || ( d.x() == 1 && d.y() == 2 ) ? 1 : 0;
 	}
@@ -190,7 +250,7 @@ class Bishop : public Piece {
 public:
 	Bishop(int color) : Piece(BISHOP, color) {}
 	
-	virtual int valid_move(const Point& point, const Board *board) {
+	virtual int valid_move(const Point& point, const Board *board) const {
 		Point d = point - m_pos;
 		if ( d.xabs() != d.yabs() ) return 0;
 		Point step = d.sign();
@@ -210,7 +270,7 @@ public:
 		m_pos = pos;
 	}
 	
-	virtual int valid_move(const Point& point, const Board *board) {
+	virtual int valid_move(const Point& point, const Board *board) const {
 		Point d = point - m_pos;
 		if (d.x() != 0 && d.y() != 0) return 0;
 		Point step = d.sign();
@@ -220,13 +280,14 @@ public:
 	}
 	
 	bool moved() const { return m_moved; }
+	bool moved(bool b) { return m_moved = b; }
 };
 
 class Queen : public Piece {
 public:
 	Queen(int color) : Piece(QUEEN, color) {}
 
-	virtual int valid_move(const Point& point, const Board *board) {
+	virtual int valid_move(const Point& point, const Board *board) const {
 		Point d = point - m_pos;
 		if ( d.x() == 0 || d.y() == 0 || ( d.xabs() == d.yabs() ) ) {
 			Point step = d.sign();
@@ -248,24 +309,117 @@ public:
 		m_pos = pos;
 	}
 	
-	virtual int valid_move(const Point& point, const Board*) {
+	virtual int valid_move(const Point& point, const Board*) const {
 		Point dabs = (point - m_pos).abs();
 		return (dabs.x() <= 1 && dabs.y() <= 1) ? 1 : 0;
 	}
 	
 	bool moved() const { return m_moved; }
+	bool moved(bool b) { return m_moved = b; }
 };
 
-class Chess {
-	friend ostream& operator<<(ostream& os, Chess& chess);
-	Board*	m_board;
-	int		m_turn;
-	Pawn*	m_en_passant;
-	Pawn*	m_to_promote;
-	King*	m_kings[2];
+// Storage for one game: the board and a slot for each of the 32 pieces it
+// can ever hold. Captured pieces go back on a free list that promotions take
+// from, so a game allocates once and then never touches the heap.
+class Arena {
+	union Slot {
+		Slot	*next;
+		char	pawn[sizeof(Pawn)];
+		char	knight[sizeof(Knight)];
+		char	bishop[sizeof(Bishop)];
+		char	rook[sizeof(Rook)];
+		char	queen[sizeof(Queen)];
+		char	king[sizeof(King)];
+	};
+	Board	m_board;
+	Slot	m_slots[32];
+	Slot	*m_free;
+
+public:
+	Arena() { reset(); }
+
+	void reset() {
+		for (int i = 0; i < 31; ++i) m_slots[i].next = &m_slots[i + 1];
+		m_slots[31].next = NULL;
+		m_free = m_slots;
+		m_board.clear();
+	}
+
+	template <class T> T *create(int color) {
+		Slot *slot = m_free;
+		if (slot == NULL) return new T(color);
+		m_free = slot->next;
+		return new (slot) T(color);
+	}
+
+	Piece *clone(const Piece *piece) {
+		switch ( piece->type() ) {
+			case Piece::PAWN: return copy( *static_cast<const Pawn*>(piece) );
+			case Piece::KNIGHT: return copy( *static_cast<const Knight*>(piece) );
+			case Piece::BISHOP: return copy( *static_cast<const Bishop*>(piece) );
+			case Piece::ROOK: return copy( *static_cast<const Rook*>(piece) );
+			case Piece::QUEEN: return copy( *static_cast<const Queen*>(piece) );
+			default: return copy( *static_cast<const King*>(piece) );
+		}
+	}
+
+	template <class T> T *copy(const T& piece) {
+		Slot *slot = m_free;
+		if (slot == NULL) return new T(piece);
+		m_free = slot->next;
+		return new (slot) T(piece);
+	}
+
+	void release(Piece *piece) {
+		if ( !owns(piece) ) {
+			delete piece;
+			return;
+		}
+		piece->~Piece();
+		Slot *slot = reinterpret_cast<Slot*>(piece);
+		slot->next = m_free;
+		m_free = slot;
+	}
+
+	// Whether all 32 slots hold pieces, so create() would go to the heap.
+	bool full() const { return m_free == NULL; }
+
+	bool owns(const Piece *piece) const {
+		const char *p = reinterpret_cast<const char*>(piece);
+		return reinterpret_cast<const char*>(m_slots) <= p && p < reinterpret_cast<const char*>(m_slots + 32);
+	}
+
+	Board *board() { return &m_board; }
+};
+
+static constexpr Point s_white_pawn_captures[2] = {
+	Point(-1, 1), Point(-1, -1)
+};
+static constexpr Point s_black_pawn_captures[2] = {
+	Point(1, 1), Point(1, -1)
+};
+static constexpr Point s_bishop_moves[4] = {
+	Point(1, 1), Point(1, -1), Point(-1, 1), Point(-1, -1)
+};
+static constexpr Point s_rook_moves[4] = {
+	Point(0, 1), Point(0, -1), Point(1, 0), Point(-1, 0)
+};
+static constexpr Point s_knight_moves[8] = {
+	Point(1, 2), Point(1, -2), Point(-1, 2), Point(-1, -2),
+	Point(2, 1), Point(2, -1), Point(-2, 1), Point(-2, -1)
+};
+static constexpr Point s_king_moves[8] = {
+	Point(0, 1), Point(0, -1), Point(1, 0), Point(-1, 0),
+	Point(1, 1), Point(1, -1), Point(-1, 1), Point(-1, -1)
+};
+
+// What every variant of the rules engine shares: the constants callers
+// name, the packed position and the Zobrist keys.
+class ChessBase {
 public:
 	enum { BLACK = 0, WHITE = 1 };
 	enum { CASTLING_KINGSIDE = 1, CASTLING_QUEENSIDE = 2 };
+	enum { WHITE_KINGSIDE = 1, WHITE_QUEENSIDE = 2, BLACK_KINGSIDE = 4, BLACK_QUEENSIDE = 8 };
 	enum { ACCEPTED = 1, PROMOTION = 2,
 			INVALID_FORMAT = -1,
 			IDLE_MOVE = -2,
@@ -274,57 +428,187 @@ public:
 			SQUARE_OCCUPIED = -5,
 			CHECK = -6,
 			INVALID_MOVE = -7 };
+	// FEN_SIZE holds the longest record to_fen() writes: eight characters
+	// per rank and both counters at MAX_COUNTER, the most Packed keeps.
+	// HISTORY_SIZE keys cover the 101 positions of a fifty-move stretch.
+	enum { MAX_MOVES = 256, FEN_SIZE = 96, MAX_COUNTER = 65535, HISTORY_SIZE = 102 };
+	// A position in 40 bytes: four bits per square, 0 for empty or
+	// piece_index() + 1, followed by what a FEN record carries and the
+	// square of a pawn waiting for its promotion piece.
+	struct Packed {
+		uint8_t		squares[32];
+		uint8_t		turn;
+		uint8_t		castling;
+		int8_t		en_passant;
+		int8_t		to_promote;
+		uint16_t	halfmove;
+		uint16_t	fullmove;
+	};
+
+	enum { IN_PROGRESS = 0, CHECKMATE = 1, STALEMATE = 2, FIFTY_MOVES = 3,
+			REPETITION = 4, INSUFFICIENT_MATERIAL = 5 };
 
-	Chess() {}
+	static uint64_t zobrist(int n) {
+		uint64_t z = (uint64_t) n * 0x9E3779B97F4A7C15ULL + 0x2545F4914F6CDD1DULL;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
 	
-	void setup() {
-		m_board = new Board();
-		m_board->clear();
-			
-		#define NEW_W_PIECE(_class, _i, _j) { \
-			_class *_p = new _class (Piece::WHITE); \
-			m_board->set(Point(_i, _j), _p); \
+	static int piece_index(const Piece *piece) {
+		int index = 0;
+		for (int type = piece->type(); type > 1; type >>= 1) ++index;
+		return index * 2 + piece->color();
+	}
+};
+
+// The parts of the rules a variant changes: the piece that starts on each
+// file of the back rank, the files castling starts from, and a key mixed
+// into hash() so that one placement with two variants' castling moves has
+// two keys. BasicChess takes them from its Rules class at compile time;
+// the standard game's are constants the compiler folds into the engine.
+// start() numbers the start position, 518 being the standard one.
+struct StandardRules {
+	enum { SHUFFLED = 0 };
+	static int back_rank(int file) {
+		static const int s_pieces[8] = {
+			Piece::ROOK, Piece::KNIGHT, Piece::BISHOP, Piece::QUEEN,
+			Piece::KING, Piece::BISHOP, Piece::KNIGHT, Piece::ROOK
+		};
+		return s_pieces[file];
+	}
+	static int king_file() { return 4; }
+	static int rook_file(int side) { return (side == ChessBase::CASTLING_KINGSIDE) ? 7 : 0; }
+	static uint64_t key() { return 0; }
+	static int start() { return 518; }
+	static void set_start(int) {}
+};
+
+// Chess960: the back rank is one of 960 arrangements with the bishops on
+// opposite colours and the king between the rooks, numbered as Scharnagl
+// did. Castling still ends with the king on the c- or g-file and the rook
+// beside it, and is written as the king moving onto its rook.
+class Chess960Rules {
+	int8_t		m_back[8];
+	int8_t		m_king;
+	int8_t		m_rooks[2];		// queenside, kingside
+	uint16_t	m_start;
+
+public:
+	enum { SHUFFLED = 1, POSITIONS = 960 };
+
+	Chess960Rules() { set_start(518); }
+
+	void set_start(int start) {
+		static const int8_t s_knights[10][2] = {
+			{0, 1}, {0, 2}, {0, 3}, {0, 4}, {1, 2}, {1, 3}, {1, 4}, {2, 3}, {2, 4}, {3, 4}
+		};
+		m_start = (uint16_t) start;
+		memset(m_back, 0, sizeof m_back);
+		int n = start;
+		m_back[2 * (n % 4) + 1] = Piece::BISHOP;
+		n /= 4;
+		m_back[2 * (n % 4)] = Piece::BISHOP;
+		n /= 4;
+		put(Piece::QUEEN, n % 6);
+		n /= 6;
+		int first = s_knights[n][0], second = s_knights[n][1];
+		put(Piece::KNIGHT, second);
+		put(Piece::KNIGHT, first);
+		put(Piece::ROOK, 0);
+		put(Piece::KING, 0);
+		put(Piece::ROOK, 0);
+		for (int file = 0; file < 8; ++file) if (m_back[file] == Piece::KING) m_king = (int8_t) file;
+		for (int file = 0; file < 8; ++file) if (m_back[file] == Piece::ROOK) m_rooks[file > m_king] = (int8_t) file;
+	}
+
+	int back_rank(int file) const { return m_back[file]; }
+	int king_file() const { return m_king; }
+	int rook_file(int side) const { return m_rooks[side == ChessBase::CASTLING_KINGSIDE]; }
+	uint64_t key() const { return ChessBase::zobrist(2048 + m_start); }
+	int start() const { return m_start; }
+
+private:
+	// Puts type on the nth empty file.
+	void put(int type, int n) {
+		for (int file = 0; file < 8; ++file) {
+			if (m_back[file] != 0) continue;
+			if (n-- == 0) {
+				m_back[file] = (int8_t) type;
+				return;
+			}
 		}
+	}
+};
 
-		#define NEW_B_PIECE(_class, _i, _j) { \
-			_class *_p = new _class (Piece::BLACK); \
-			m_board->set(Point(_i, _j), _p); \
+template <class Rules>
+class BasicChess : public ChessBase, public Rules {
+	Arena*	m_arena;
+	Board*	m_board;
+	int		m_turn;
+	Pawn*	m_en_passant;
+	Pawn*	m_to_promote;
+	King*	m_kings[2];
+	int		m_halfmove;
+	int		m_fullmove;
+	uint64_t	m_key;
+	int		m_counts[12];
+	uint64_t	m_history[HISTORY_SIZE];
+	int		m_history_size;
+public:
+	BasicChess() { m_arena = NULL; m_board = NULL; }
+	BasicChess(const BasicChess& chess) { m_arena = NULL; m_board = NULL; *this = chess; }
+	~BasicChess() { delete m_arena; }
+	
+	BasicChess& operator=(const BasicChess& chess) {
+		if (this == &chess) return *this;
+		Rules::operator=(chess);
+		if (m_arena == NULL) m_arena = new Arena();
+		m_arena->reset();
+		m_board = m_arena->board();
+		m_turn = chess.m_turn;
+		m_halfmove = chess.m_halfmove;
+		m_fullmove = chess.m_fullmove;
+		m_key = chess.m_key;
+		memcpy(m_counts, chess.m_counts, sizeof m_counts);
+		m_history_size = chess.m_history_size;
+		memcpy(m_history, chess.m_history, m_history_size * sizeof m_history[0]);
+		m_en_passant = NULL;
+		m_to_promote = NULL;
+		for (int i = 0; i < 8; ++i) {
+			for (int j = 0; j < 8; ++j) {
+				Piece *piece = chess.m_board->get( Point(i, j) );
+				if (piece == NULL) continue;
+				Piece *copy = m_arena->clone(piece);
+				m_board->set(Point(i, j), copy);
+				if (piece == chess.m_en_passant) m_en_passant = static_cast<Pawn*>(copy);
+				if (piece == chess.m_to_promote) m_to_promote = static_cast<Pawn*>(copy);
+				if (piece->type() == Piece::KING) m_kings[piece->color()] = static_cast<King*>(copy);
+			}
 		}
-		
-		int i, j;
-		i = 6;
-		for (j = 0; j < 8; ++j)
-			NEW_W_PIECE(Pawn, i, j);
-		NEW_W_PIECE(Rook, 7, 0);
-		NEW_W_PIECE(Rook, 7, 7);
-		NEW_W_PIECE(Knight, 7, 1);
-		NEW_W_PIECE(Knight, 7, 6);
-		NEW_W_PIECE(Bishop, 7, 2);
-		NEW_W_PIECE(Bishop, 7, 5);
-		NEW_W_PIECE(Queen, 7, 3);
-		NEW_W_PIECE(King, 7, 4);
-		
-		i = 1;
-		for (j = 0; j < 8; ++j)
-			NEW_B_PIECE(Pawn, i, j);
-		NEW_B_PIECE(Rook, 0, 0);
-		NEW_B_PIECE(Rook, 0, 7);
-		NEW_B_PIECE(Knight, 0, 1);
-		NEW_B_PIECE(Knight, 0, 6);
-		NEW_B_PIECE(Bishop, 0, 2);
-		NEW_B_PIECE(Bishop, 0, 5);
-		NEW_B_PIECE(Queen, 0, 3);
-		NEW_B_PIECE(King, 0, 4);
-		
-		#undef NEW_W_PIECE
-		#undef NEW_B_PIECE
-		
+		return *this;
+	}
+	
+	void setup() {
+		if (m_arena == NULL) m_arena = new Arena();
+		m_arena->reset();
+		m_board = m_arena->board();
+		m_kings[BLACK] = m_kings[WHITE] = NULL;
+		for (int j = 0; j < 8; ++j) {
+			place(Rules::back_rank(j), BLACK, Point(0, j));
+			place(Piece::PAWN, BLACK, Point(1, j));
+			place(Piece::PAWN, WHITE, Point(6, j));
+			place(Rules::back_rank(j), WHITE, Point(7, j));
+		}
+		restore_rights(WHITE_KINGSIDE | WHITE_QUEENSIDE | BLACK_KINGSIDE | BLACK_QUEENSIDE);
 		setup(m_board);
 	}
 	
 	void setup(Board *board, int turn = WHITE) {
 		m_board = board;
 		m_turn = turn;
+		m_halfmove = 0;
+		m_fullmove = 1;
 		m_en_passant = NULL;
 		m_to_promote = NULL;
 		for (int i = 0; i < 8; i++) {
@@ -334,129 +618,388 @@ public:
 					m_kings[piece->color()] = static_cast<King*>(piece);
 			}
 		}
+		rehash();
+	}
+	
+	// Loads the placement, side to move, castling and en-passant fields of
+	// a FEN record. Returns false if they are malformed or a king is missing.
+	bool setup(const char *fen) {
+		static const char s_letters[] = "pnbrqk";
+		if (m_arena == NULL) m_arena = new Arena();
+		m_arena->reset();
+		m_board = m_arena->board();
+		m_turn = WHITE;
+		m_halfmove = 0;
+		m_fullmove = 1;
+		m_en_passant = NULL;
+		m_to_promote = NULL;
+		m_kings[BLACK] = m_kings[WHITE] = NULL;
+		
+		const char *p = fen;
+		int x = 0, y = 0;
+		for (; *p != ' '; ++p) {
+			if (*p == '/') {
+				if (y != 8 || ++x > 7) return false;
+				y = 0;
+				continue;
+			}
+			if ('1' <= *p && *p <= '8') {
+				y += *p - '0';
+				if (y > 8) return false;
+				continue;
+			}
+			if (y > 7) return false;
+			int color = ('a' <= *p && *p <= 'z') ? BLACK : WHITE;
+			const char *letter = strchr(s_letters, *p | 0x20);
+			if ( letter == NULL || place(1 << (letter - s_letters), color, Point(x, y++)) == NULL ) return false;
+		}
+		if (x != 7 || y != 8 || m_kings[BLACK] == NULL || m_kings[WHITE] == NULL) return false;
+		
+		++p;
+		if (*p != 'w' && *p != 'b') return false;
+		m_turn = (*p == 'w') ? WHITE : BLACK;
+		if (*++p != ' ') return false;
+		
+		int rights = 0;
+		for (++p; *p != ' '; ++p) {
+			switch (*p) {
+				case 'K': rights |= WHITE_KINGSIDE; break;
+				case 'Q': rights |= WHITE_QUEENSIDE; break;
+				case 'k': rights |= BLACK_KINGSIDE; break;
+				case 'q': rights |= BLACK_QUEENSIDE; break;
+				case '-': break;
+				default: return false;
+			}
+		}
+		restore_rights(rights);
+		
+		++p;
+		if (*p == '-') {
+			++p;
+		} else {
+			// The target is the square an enemy pawn just skipped: on the
+			// sixth rank for white to move, the third for black, empty, and
+			// with the pawn behind it and nothing on the square it left.
+			Point target;
+			if ( p[1] == '\0' || !target.from_string(p) || target.x() != (m_turn == WHITE ? 2 : 5) ) return false;
+			Point step(m_turn == WHITE ? 1 : -1, 0);
+			Point pos = target + step;
+			Piece *piece = m_board->get(pos);
+			if (piece == NULL || piece->type() != Piece::PAWN || piece->color() == m_turn ||
+					m_board->get(target) != NULL || m_board->get(target - step) != NULL) return false;
+			m_en_passant = static_cast<Pawn*>(piece);
+			m_en_passant->en_passant(true);
+			p += 2;
+		}
+		
+		rehash();
+		if (*p == '\0') return true;
+		if (*p != ' ') return false;
+		m_halfmove = 0;
+		for (++p; '0' <= *p && *p <= '9'; ++p)
+			if ( (m_halfmove = m_halfmove * 10 + (*p - '0')) > MAX_COUNTER ) return false;
+		if (*p != ' ') return *p == '\0';
+		m_fullmove = 0;
+		for (++p; '0' <= *p && *p <= '9'; ++p)
+			if ( (m_fullmove = m_fullmove * 10 + (*p - '0')) > MAX_COUNTER ) return false;
+		if (m_fullmove < 1) m_fullmove = 1;
+		return *p == '\0' || *p == ' ' || *p == '\n' || *p == '\r';
 	}
 	
+	// Writes the position as a FEN record into fen, which must hold
+	// FEN_SIZE bytes, and returns its length.
+	int to_fen(char *fen) const {
+		static const char letters[] = " PNBRQK";
+		char *p = fen;
+		for (int i = 0; i < 8; ++i) {
+			int empty = 0;
+			for (int j = 0; j < 8; ++j) {
+				Piece *piece = m_board->get( Point(i, j) );
+				if (piece == NULL) {
+					++empty;
+					continue;
+				}
+				if (empty > 0) *p++ = (char) ('0' + empty);
+				empty = 0;
+				char c = letters[ piece_index(piece) / 2 + 1 ];
+				*p++ = (piece->color() == WHITE) ? c : (char) (c | 0x20);
+			}
+			if (empty > 0) *p++ = (char) ('0' + empty);
+			*p++ = (i < 7) ? '/' : ' ';
+		}
+		*p++ = (m_turn == WHITE) ? 'w' : 'b';
+		*p++ = ' ';
+		int rights = castling_rights();
+		if (rights & WHITE_KINGSIDE) *p++ = 'K';
+		if (rights & WHITE_QUEENSIDE) *p++ = 'Q';
+		if (rights & BLACK_KINGSIDE) *p++ = 'k';
+		if (rights & BLACK_QUEENSIDE) *p++ = 'q';
+		if (rights == 0) *p++ = '-';
+		*p++ = ' ';
+		if (m_en_passant != NULL) {
+			Point pos = m_en_passant->pos() + Point(m_turn == WHITE ? -1 : 1, 0);
+			pos.to_string(p);
+			p += 2;
+		} else {
+			*p++ = '-';
+		}
+		*p++ = ' ';
+		p = write_number(p, m_halfmove);
+		*p++ = ' ';
+		p = write_number(p, m_fullmove);
+		*p = '\0';
+		return (int) (p - fen);
+	}
+	
+	void pack(Packed& packed) const {
+		memset(&packed, 0, sizeof packed);
+		for (int i = 0; i < 64; ++i) {
+			Piece *piece = m_board->get( Point(i / 8, i % 8) );
+			if (piece != NULL) packed.squares[i / 2] |= (uint8_t) ((piece_index(piece) + 1) << (i % 2 * 4));
+		}
+		packed.turn = (uint8_t) m_turn;
+		packed.castling = (uint8_t) castling_rights();
+		packed.en_passant = (int8_t) (m_en_passant != NULL ? m_en_passant->pos().y() : -1);
+		packed.to_promote = (int8_t) (m_to_promote != NULL ? m_to_promote->pos().index() : -1);
+		packed.halfmove = (uint16_t) m_halfmove;
+		packed.fullmove = (uint16_t) m_fullmove;
+	}
+
+	// The inverse of pack(). recent, if given, holds the last n keys from
+	// history() and lets repetitions reach back before the unpacked position.
+	bool unpack(const Packed& packed, const uint64_t *recent = NULL, int n = 0) {
+		if (m_arena == NULL) m_arena = new Arena();
+		m_arena->reset();
+		m_board = m_arena->board();
+		m_turn = packed.turn;
+		m_halfmove = packed.halfmove;
+		m_fullmove = packed.fullmove;
+		m_en_passant = NULL;
+		m_to_promote = NULL;
+		m_kings[BLACK] = m_kings[WHITE] = NULL;
+		for (int i = 0; i < 64; ++i) {
+			int code = (packed.squares[i / 2] >> (i % 2 * 4)) & 15;
+			if (code == 0) continue;
+			if ( place(1 << ((code - 1) >> 1), (code - 1) & 1, Point(i / 8, i % 8)) == NULL ) return false;
+		}
+		if (m_kings[BLACK] == NULL || m_kings[WHITE] == NULL) return false;
+		restore_rights(packed.castling);
+		if (packed.en_passant >= 0) {
+			Piece *piece = m_board->get( Point(m_turn == WHITE ? 3 : 4, packed.en_passant) );
+			if (piece == NULL || piece->type() != Piece::PAWN || piece->color() == m_turn) return false;
+			m_en_passant = static_cast<Pawn*>(piece);
+			m_en_passant->en_passant(true);
+		}
+		if (packed.to_promote >= 0) {
+			Piece *piece = m_board->get( Point(packed.to_promote / 8, packed.to_promote % 8) );
+			if (piece == NULL || piece->type() != Piece::PAWN) return false;
+			m_to_promote = static_cast<Pawn*>(piece);
+		}
+		rehash();
+		if (recent != NULL && n > 0 && n <= (int) (sizeof m_history / sizeof m_history[0])) {
+			memcpy(m_history, recent, n * sizeof m_history[0]);
+			m_history_size = n;
+		}
+		return true;
+	}
+
+	// Copies the keys of the last positions since the last irreversible
+	// move, oldest first, and returns how many were copied.
+	int history(uint64_t *keys, int max) const {
+		int n = min(max, m_history_size);
+		memcpy(keys, m_history + m_history_size - n, n * sizeof m_history[0]);
+		return n;
+	}
+
 	int enter_move(const char *str) {
-		Point p1, p2;
-		if ( p1.from_string(str) && p2.from_string(str + 2) ) {
-			if (p1 == p2) return IDLE_MOVE;
-			Piece *piece1 = m_board->get(p1);
-			if (piece1 == NULL) return NO_SUCH_PIECE;
-			if (piece1->color() != m_turn) return NOT_IN_TURN;
-			Piece *piece2 = m_board->get(p2);
-			if ( piece2 != NULL && piece2->color() == piece1->color() ) return SQUARE_OCCUPIED;
-			if ( check(p1, p2) ) return CHECK;
-			int status = piece1->valid_move(p2, m_board);
-			if (status == 0) {
-				return INVALID_MOVE;
-			} else if (status == 1) {
-				m_board->move_piece(p1, p2);
-				delete piece2;
-				switchTurn();
-				return ACCEPTED;
-			} else if (status == 2) {
+		Move move;
+		if ( parse_move(str, move) ) {
+			return enter_move(move);
+		} else if (str[0] == '=') {
+			int promotion_status = handle_promotion(str);
+			if (promotion_status == ACCEPTED) {
 				switchTurn();
-				m_en_passant = static_cast<Pawn*>(piece1);
-				m_en_passant->en_passant(true);
-				m_board->move_piece(p1, p2);
-				delete piece2;
-				return ACCEPTED;
-			} else if (status == 3) {
-				m_board->set_piece( NULL, m_en_passant->pos() );
-				delete m_en_passant;
-				m_en_passant = NULL;
-				m_board->move_piece(p1, p2);
+				record();
+			}
+			return promotion_status;
+		}
+		return INVALID_MOVE;
+	}
+	
+	// Move::from_string() for this variant. In Chess960 castling is the king
+	// moving onto its rook, which "O-O", "O-O-O" and a king sent onto its
+	// own castling rook are all turned into.
+	bool parse_move(const char *str, Move& move) const {
+		if ( !move.from_string(str, m_turn) ) return false;
+		if (!Rules::SHUFFLED) return true;
+		int rank = (m_turn == WHITE) ? 7 : 0;
+		Point king(rank, Rules::king_file());
+		if (move.kind() == Move::CASTLING) {
+			int side = (move.to().y() > move.from().y()) ? CASTLING_KINGSIDE : CASTLING_QUEENSIDE;
+			move = Move( king, Point(rank, Rules::rook_file(side)), Move::CASTLING );
+		} else if (move.kind() == Move::NORMAL && move.from() == king && move.to().x() == rank) {
+			int side = (move.to().y() > king.y()) ? CASTLING_KINGSIDE : CASTLING_QUEENSIDE;
+			Piece *piece = m_board->get(king), *rook = m_board->get( move.to() );
+			if ( move.to().y() == Rules::rook_file(side) && piece != NULL && piece->type() == Piece::KING
+					&& rook != NULL && rook->type() == Piece::ROOK && rook->color() == m_turn )
+				move = Move(king, move.to(), Move::CASTLING);
+		}
+		return true;
+	}
+	
+	// checked: the caller already knows the move does not leave the king in
+	// check, as for moves MoveBatch passed.
+	int enter_move(const Move& move, bool checked = false) {
+		if (move.kind() == Move::CASTLING) {
+			int side = (move.to().y() > move.from().y()) ? CASTLING_KINGSIDE : CASTLING_QUEENSIDE;
+			int castling_status = handle_castling(side);
+			if (castling_status == ACCEPTED) {
+				++m_halfmove;
 				switchTurn();
-				return ACCEPTED;
-			} else if (status == 4) {
-				m_to_promote = static_cast<Pawn*>(piece1);
-				m_board->move_piece(p1, p2);
-				delete piece2;
-				return PROMOTION;
+				record();
 			}
-		} else if (string(str) == "O-O") {
-			int castling_status = handle_castling(CASTLING_KINGSIDE);
-			if (castling_status == ACCEPTED) switchTurn();
-			return castling_status;
-		} else if (string(str) == "O-O-O") {
-			int castling_status = handle_castling(CASTLING_QUEENSIDE);
-			if (castling_status == ACCEPTED) switchTurn();
 			return castling_status;
-		} else if (str[0] == '=') {
+		}
+		Point p1 = move.from(), p2 = move.to();
+		int status = validate(p1, p2, checked);
+		if (status <= 0) return status;
+		Piece *piece1 = m_board->get(p1);
+		Piece *piece2 = m_board->get(p2);
+		m_halfmove = (piece1->type() == Piece::PAWN || piece2 != NULL) ? 0 : m_halfmove + 1;
+		toggle(piece1, p1);
+		toggle(piece1, p2);
+		if (status == 1) {
+			m_board->move_piece(p1, p2);
+			capture(piece2, p2);
+			switchTurn();
+			record();
+			return ACCEPTED;
+		} else if (status == 2) {
+			m_board->move_piece(p1, p2);
+			switchTurn();
+			m_en_passant = static_cast<Pawn*>(piece1);
+			m_en_passant->en_passant(true);
+			record();
+			return ACCEPTED;
+		} else if (status == 3) {
+			Pawn *captured = m_en_passant;
+			m_en_passant = NULL;
+			m_board->set_piece( NULL, captured->pos() );
+			capture( captured, captured->pos() );
+			m_board->move_piece(p1, p2);
+			switchTurn();
+			record();
+			return ACCEPTED;
+		} else if (status == 4) {
+			m_to_promote = static_cast<Pawn*>(piece1);
+			m_board->move_piece(p1, p2);
+			capture(piece2, p2);
+			if (move.kind() == Move::NORMAL) return PROMOTION;
+			static const char promotions[] = " NBRQ";
+			const char str[3] = { '=', promotions[move.kind()], '\0' };
 			int promotion_status = handle_promotion(str);
-			if (promotion_status == ACCEPTED) switchTurn();
+			if (promotion_status == ACCEPTED) {
+				switchTurn();
+				record();
+			}
 			return promotion_status;
 		}
 		return INVALID_MOVE;
 	}
 	
+	int validate(const Point& p1, const Point& p2, bool checked = false) {
+		if (p1 == p2) return IDLE_MOVE;
+		Piece *piece1 = m_board->get(p1);
+		if (piece1 == NULL) return NO_SUCH_PIECE;
+		if (piece1->color() != m_turn) return NOT_IN_TURN;
+		Piece *piece2 = m_board->get(p2);
+		if ( piece2 != NULL && piece2->color() == piece1->color() ) return SQUARE_OCCUPIED;
+		int status = piece1->valid_move(p2, m_board);
+		if (status == 0) return INVALID_MOVE;
+		if ( !checked && check(p1, p2) ) return CHECK;
+		return status;
+	}
+	
 	int check(const Point& p1, const Point& p2) {
 		Piece *piece1 = m_board->get(p1);
 		Piece *piece2 = m_board->get(p2);
+		Piece *captured = NULL;
+		Point captured_pos(p1.x(), p2.y());
+		if (piece2 == NULL && piece1->type() == Piece::PAWN && p1.y() != p2.y()) {
+			captured = m_board->get(captured_pos);
+			m_board->set(captured_pos, NULL);
+		}
 		m_board->set(p1, NULL);
 		m_board->set(p2, piece1);
 		King *king = m_kings[m_turn];
 		int type = under_attack( king->pos(), king->color() );
 		m_board->set(p1, piece1);
 		m_board->set(p2, piece2);
+		if (captured != NULL) m_board->set(captured_pos, captured);
 		return type;
 	}
 	
 	int handle_castling(int side) {
-		Point rook_position, king_position;
-		if (m_turn == WHITE) {
-			king_position = Point("e1");
-			rook_position = (side == CASTLING_QUEENSIDE) ? Point("a1") : Point("h1");
-		} else {
-			king_position = Point("e8");
-			rook_position = (side == CASTLING_QUEENSIDE) ? Point("a8") : Point("h8");
-		}
+		int status = can_castle(side);
+		if (status != ACCEPTED) return status;
+		int rank = (m_turn == WHITE) ? 7 : 0;
+		Point king_position(rank, Rules::king_file()), rook_position(rank, Rules::rook_file(side));
+		Point new_king_position(rank, side == CASTLING_QUEENSIDE ? 2 : 6);
+		Point new_rook_position(rank, side == CASTLING_QUEENSIDE ? 3 : 5);
+		Piece *king = m_board->get(king_position);
+		Piece *rook = m_board->get(rook_position);
+		toggle(king, king_position);
+		toggle(king, new_king_position);
+		toggle(rook, rook_position);
+		toggle(rook, new_rook_position);
+		// In Chess960 either piece may land where the other stood.
+		m_board->set(king_position, NULL);
+		m_board->set(rook_position, NULL);
+		m_board->set(new_king_position, king);
+		m_board->set(new_rook_position, rook);
+		king->move(new_king_position);
+		rook->move(new_rook_position);
+		return ACCEPTED;
+	}
+	
+	int can_castle(int side) const {
+		int rank = (m_turn == WHITE) ? 7 : 0;
+		Point king_position(rank, Rules::king_file()), rook_position(rank, Rules::rook_file(side));
+		Point new_king_position(rank, side == CASTLING_QUEENSIDE ? 2 : 6);
+		Point new_rook_position(rank, side == CASTLING_QUEENSIDE ? 3 : 5);
 		Piece *king = m_board->get(king_position);
 		Piece *rook = m_board->get(rook_position);
 		if (king == NULL || rook == NULL) return NO_SUCH_PIECE;
 		if (king->type() != Piece::KING || rook->type() != Piece::ROOK) return NO_SUCH_PIECE;
+		if (king->color() != m_turn || rook->color() != m_turn) return NO_SUCH_PIECE;
 		if ( static_cast<King*>(king)->moved() || static_cast<Rook*>(rook)->moved() ) return INVALID_MOVE;
-		if ( !rook->valid_move(king_position, m_board) ) return SQUARE_OCCUPIED;
-		Point new_king_position, new_rook_position, step;
-		if (side == CASTLING_QUEENSIDE) {
-			new_rook_position = rook_position + Point(0, 3);
-			new_king_position = king_position + Point(0, -2);
-			step = Point(0, -1);
-		} else {
-			new_rook_position = rook_position + Point(0, -2);
-			new_king_position = king_position + Point(0, 2);
-			step = Point(0, 1);
-		}
-		for (Point pos = king_position; pos != new_king_position; pos += step)
-			if ( under_attack(pos, king->color()) ) return CHECK;
-		if ( under_attack(new_king_position, king->color()) ) return CHECK;
-		m_board->move_piece(king_position, new_king_position);
-		m_board->move_piece(rook_position, new_rook_position);
-		return ACCEPTED;
+		int first = min( min(king_position.y(), new_king_position.y()), min(rook_position.y(), new_rook_position.y()) );
+		int last = max( max(king_position.y(), new_king_position.y()), max(rook_position.y(), new_rook_position.y()) );
+		for (int y = first; y <= last; ++y) {
+			Piece *piece = m_board->get( Point(rank, y) );
+			if (piece != NULL && piece != king && piece != rook) return SQUARE_OCCUPIED;
+		}
+		// A Chess960 rook may stand between the king's path and an attacker
+		// on the rank, and it will not once it has moved.
+		if (Rules::SHUFFLED) m_board->set(rook_position, NULL);
+		int status = ACCEPTED;
+		Point step( 0, (new_king_position.y() < king_position.y()) ? -1 : 1 );
+		for (Point pos = king_position; ; pos += step) {
+			if ( under_attack(pos, king->color()) ) {
+				status = CHECK;
+				break;
+			}
+			if (pos == new_king_position) break;
+		}
+		if (Rules::SHUFFLED) m_board->set(rook_position, rook);
+		return status;
 	}
 	
-	int under_attack(const Point& pos, int color) {
-		static Point white_pawn_moves[2] = {
-			Point(-1, 1), Point(-1, -1)
-		};
-		static Point black_pawn_moves[2] = {
-			Point(1, 1), Point(1, -1)
-		};
-		static Point bishop_moves[4] = {
-			Point(1, 1), Point(1, -1), Point(1, -1), Point(-1, -1)
-		};
-		static Point rook_moves[4] = {
-			Point(0, 1), Point(0, -1), Point(1, 0), Point(-1, 0)
-		};
-		static Point knight_moves[8] = {
-			Point(1, 2), Point(1, -2), Point(-1, 2), Point(-1, -2),
-			Point(2, 1), Point(2, -1), Point(-2, 1), Point(-2, -1)
-		};
-		
+	int under_attack(const Point& pos, int color) const {
 		int type = 0;
 		
 		for (int i = 0; i < 4; ++i) {
-			Point& step = bishop_moves[i];
+			const Point& step = s_bishop_moves[i];
 			for (Point p = pos + step; p.in_range(); p += step) {
 				Piece *piece = m_board->get(p);
 				if (piece == NULL) continue;
@@ -468,7 +1011,7 @@ public:
 		}
 		
 		for (int i = 0; i < 4; ++i) {
-			Point& step = rook_moves[i];
+			const Point& step = s_rook_moves[i];
 			for (Point p = pos + step; p.in_range(); p += step) {
 				Piece *piece = m_board->get(p);
 				if (piece == NULL) continue;
@@ -480,7 +1023,7 @@ public:
 		}
 		
 		for (int i = 0; i < 8; ++i) {
-			Point p = pos + knight_moves[i];
+			Point p = pos + s_knight_moves[i];
 			if ( !p.in_range() ) continue;
 			Piece *piece = m_board->get(p);
 			if (piece == NULL) continue;
@@ -488,7 +1031,7 @@ public:
 				return type |= Piece::KNIGHT;
 		}
 		
-		Point *moves = (color == Piece::WHITE) ? white_pawn_moves : black_pawn_moves;
+		const Point *moves = (color == Piece::WHITE) ? s_white_pawn_captures : s_black_pawn_captures;
 		for (int i = 0; i < 2; ++i) {
 			Point p = pos + moves[i];
 			if ( !p.in_range() ) continue;
@@ -498,35 +1041,247 @@ public:
 				return type |= Piece::PAWN;
 		}
 		
+		for (int i = 0; i < 8; ++i) {
+			Point p = pos + s_king_moves[i];
+			if ( !p.in_range() ) continue;
+			Piece *piece = m_board->get(p);
+			if (piece == NULL) continue;
+			if ( piece->color() != color && (piece->type() & Piece::KING) )
+				return type |= Piece::KING;
+		}
+		
 		return type;
 	}
 	
 	int handle_promotion(const char *str) {
 		if (m_to_promote == NULL) return INVALID_MOVE;
+		int color = m_to_promote->color();
+		Point pos = m_to_promote->pos();
+		if (str[1] != 'N' && str[1] != 'B' && str[1] != 'R' && str[1] != 'Q') return INVALID_FORMAT;
+		capture(m_to_promote, pos);
+		m_to_promote = NULL;
 		Piece *promoted;
 		switch (str[1]) {
 			case 'N':
-				promoted = new Knight(m_to_promote->color());
+				promoted = create<Knight>(color);
 				break;
 			case 'B':
-				promoted = new Bishop(m_to_promote->color());
+				promoted = create<Bishop>(color);
 				break;
 			case 'R':
-				promoted = new Rook(m_to_promote->color());
-				break;
-			case 'Q':
-				promoted = new Queen(m_to_promote->color());
+				promoted = create<Rook>(color);
 				break;
 			default:
-				return INVALID_FORMAT;
+				promoted = create<Queen>(color);
+				break;
 		}
-		m_board->set_piece(promoted, m_to_promote->pos());
-		delete m_to_promote;
-		m_to_promote = NULL;
+		m_board->set_piece(promoted, pos);
+		toggle(promoted, pos);
+		++m_counts[ piece_index(promoted) ];
 		return ACCEPTED;
 	}
 	
+	// Stops after the piece that brings the count to limit; moves must have
+	// room for MAX_MOVES either way.
+	int legal_moves(Move *moves, int limit = MAX_MOVES) {
+		int n = 0;
+		for (int i = 0; i < 8; ++i) {
+			for (int j = 0; j < 8 && n < limit; ++j) {
+				Point from(i, j);
+				Piece *piece = m_board->get(from);
+				if (piece == NULL || piece->color() != m_turn) continue;
+				switch ( piece->type() ) {
+					case Piece::PAWN: {
+						int dir = (m_turn == WHITE) ? -1 : 1;
+						n = add_move( moves, n, from, from + Point(dir, 0) );
+						n = add_move( moves, n, from, from + Point(2 * dir, 0) );
+						n = add_move( moves, n, from, from + Point(dir, 1) );
+						n = add_move( moves, n, from, from + Point(dir, -1) );
+						break;
+					}
+					case Piece::KNIGHT:
+						for (int k = 0; k < 8; ++k) n = add_move(moves, n, from, from + s_knight_moves[k]);
+						break;
+					case Piece::BISHOP:
+						n = add_slides(moves, n, from, s_bishop_moves, 4);
+						break;
+					case Piece::ROOK:
+						n = add_slides(moves, n, from, s_rook_moves, 4);
+						break;
+					case Piece::QUEEN:
+						n = add_slides(moves, n, from, s_bishop_moves, 4);
+						n = add_slides(moves, n, from, s_rook_moves, 4);
+						break;
+					case Piece::KING:
+						for (int k = 0; k < 8; ++k) n = add_move(moves, n, from, from + s_king_moves[k]);
+						if (can_castle(CASTLING_KINGSIDE) == ACCEPTED)
+							moves[n++] = castling_move(CASTLING_KINGSIDE);
+						if (can_castle(CASTLING_QUEENSIDE) == ACCEPTED)
+							moves[n++] = castling_move(CASTLING_QUEENSIDE);
+						break;
+				}
+			}
+		}
+		return n;
+	}
+	
+	// Fills targets[from.index()] with a bit for each square the piece on
+	// from can legally move to, and returns the number of legal moves.
+	int legal_targets(uint64_t *targets) {
+		Move moves[MAX_MOVES];
+		int n = legal_moves(moves);
+		memset(targets, 0, 64 * sizeof targets[0]);
+		for (int i = 0; i < n; ++i)
+			targets[ moves[i].from().index() ] |= (uint64_t) 1 << moves[i].to().index();
+		return n;
+	}
+	
+	int enter_san(const char *san) {
+		Move move;
+		int status = parse_san(san, move);
+		return (status == ACCEPTED) ? enter_move(move) : status;
+	}
+	
+	int parse_san(const char *san, Move& move) {
+		char str[8];
+		int n = 0;
+		for (const char *c = san; *c != '\0'; ++c) {
+			if (*c == 'x' || *c == '+' || *c == '#' || *c == '!' || *c == '?' || *c == '=') continue;
+			if (n == 7) return INVALID_FORMAT;
+			str[n++] = (*c == '0') ? 'O' : *c;
+		}
+		str[n] = '\0';
+		if (strcmp(str, "O-O") == 0 || strcmp(str, "O-O-O") == 0)
+			return move.from_string(str, m_turn) ? ACCEPTED : INVALID_FORMAT;
+		
+		int kind = Move::NORMAL;
+		switch (n > 0 ? str[n - 1] : '\0') {
+			case 'N': kind = Move::KNIGHT; break;
+			case 'B': kind = Move::BISHOP; break;
+			case 'R': kind = Move::ROOK; break;
+			case 'Q': kind = Move::QUEEN; break;
+		}
+		if (kind != Move::NORMAL) str[--n] = '\0';
+		
+		int type = Piece::PAWN;
+		const char *p = str;
+		switch (*p) {
+			case 'N': type = Piece::KNIGHT; ++p; break;
+			case 'B': type = Piece::BISHOP; ++p; break;
+			case 'R': type = Piece::ROOK; ++p; break;
+			case 'Q': type = Piece::QUEEN; ++p; break;
+			case 'K': type = Piece::KING; ++p; break;
+		}
+		int len = (int) (str + n - p);
+		if (len < 2 || len > 4) return INVALID_FORMAT;
+		Point target;
+		if ( !target.from_string(p + len - 2) ) return INVALID_FORMAT;
+		int file = -1, rank = -1;
+		for (const char *c = p; c < p + len - 2; ++c) {
+			if ('a' <= *c && *c <= 'h') file = *c - 'a';
+			else if ('1' <= *c && *c <= '8') rank = 7 - (*c - '1');
+			else return INVALID_FORMAT;
+		}
+		
+		int found = 0;
+		for (int i = 0; i < 8; ++i) {
+			if (rank >= 0 && i != rank) continue;
+			for (int j = 0; j < 8; ++j) {
+				if (file >= 0 && j != file) continue;
+				Piece *piece = m_board->get(Point(i, j));
+				if (piece == NULL || piece->type() != type || piece->color() != m_turn) continue;
+				int status = validate(Point(i, j), target);
+				if (status <= 0) continue;
+				if ( (status == 4) != (kind != Move::NORMAL) ) return INVALID_FORMAT;
+				move = Move(Point(i, j), target, kind);
+				++found;
+			}
+		}
+		if (found == 0) return INVALID_MOVE;
+		return (found == 1) ? ACCEPTED : INVALID_FORMAT;
+	}
+	
+	int castling_rights() const {
+		int rights = 0;
+		int king = Rules::king_file();
+		int kingside = Rules::rook_file(CASTLING_KINGSIDE), queenside = Rules::rook_file(CASTLING_QUEENSIDE);
+		if ( unmoved(Point(7, king), Piece::KING) ) {
+			if ( unmoved(Point(7, kingside), Piece::ROOK) ) rights |= WHITE_KINGSIDE;
+			if ( unmoved(Point(7, queenside), Piece::ROOK) ) rights |= WHITE_QUEENSIDE;
+		}
+		if ( unmoved(Point(0, king), Piece::KING) ) {
+			if ( unmoved(Point(0, kingside), Piece::ROOK) ) rights |= BLACK_KINGSIDE;
+			if ( unmoved(Point(0, queenside), Piece::ROOK) ) rights |= BLACK_QUEENSIDE;
+		}
+		return rights;
+	}
+	
+	int en_passant_file() const {
+		if (m_en_passant == NULL) return -1;
+		Point pos = m_en_passant->pos();
+		for (int dy = -1; dy <= 1; dy += 2) {
+			Point p = pos + Point(0, dy);
+			if ( !p.in_range() ) continue;
+			Piece *piece = m_board->get(p);
+			if (piece != NULL && piece->type() == Piece::PAWN && piece->color() == m_turn)
+				return pos.y();
+		}
+		return -1;
+	}
+	
+	uint64_t hash() const {
+		uint64_t key = m_key ^ Rules::key();
+		if (m_turn == WHITE) key ^= zobrist(768);
+		int rights = castling_rights();
+		for (int i = 0; i < 4; ++i)
+			if ( rights & (1 << i) ) key ^= zobrist(769 + i);
+		int file = en_passant_file();
+		if (file >= 0) key ^= zobrist(773 + file);
+		return key;
+	}
+	
+	// Result of the game in the current position. Draws by repetition and
+	// by the fifty-move rule are declared as soon as they can be claimed.
+	int status() {
+		if ( insufficient_material() ) return INSUFFICIENT_MATERIAL;
+		Move moves[MAX_MOVES];
+		if (legal_moves(moves, 1) == 0) return in_check() ? CHECKMATE : STALEMATE;
+		return history_status();
+	}
+	
+	// The draws that depend on how the position was reached rather than on
+	// the position itself, which is all hash() describes.
+	int history_status() const {
+		if (m_halfmove >= 100) return FIFTY_MOVES;
+		if (repetitions() >= 3) return REPETITION;
+		return IN_PROGRESS;
+	}
+	
+	int repetitions() const {
+		int n = 0;
+		for (int i = m_history_size - 1; i >= 0; i -= 2)
+			if (m_history[i] == m_history[m_history_size - 1]) ++n;
+		return n;
+	}
+	
+	bool insufficient_material() const {
+		const int *c = m_counts;
+		if (c[0] + c[1] + c[6] + c[7] + c[8] + c[9] > 0) return false;
+		int knights = c[2] + c[3], bishops = c[4] + c[5];
+		if (knights + bishops <= 1) return true;
+		if (knights > 0) return false;
+		int squares = 0;
+		for (int i = 0; i < 8; ++i) {
+			for (int j = 0; j < 8; ++j) {
+				Piece *piece = m_board->get( Point(i, j) );
+				if (piece != NULL && piece->type() == Piece::BISHOP) squares |= 1 << ((i + j) & 1);
+			}
+		}
+		return squares != 3;
+	}
+	
 	int switchTurn() {
+		if (m_turn == BLACK) ++m_fullmove;
 		if (m_en_passant != NULL) {
 			m_en_passant->en_passant(false);
 			m_en_passant = NULL;
@@ -534,10 +1289,165 @@ public:
 		return m_turn ^= (WHITE ^ BLACK);
 	}
 	
+	int in_check() const { return under_attack( m_kings[m_turn]->pos(), m_turn ); }
 	int turn() const { return m_turn; }
+	int halfmove() const { return m_halfmove; }
+	int fullmove() const { return m_fullmove; }
 	const Board& board() const { return *m_board; }
+
+private:
+	// Pieces of a board set up by setup() live in the arena; a board handed
+	// to setup(Board*) keeps its own heap pieces.
+	template <class T> Piece *create(int color) {
+		if (m_arena != NULL && m_board == m_arena->board()) return m_arena->create<T>(color);
+		return new T(color);
+	}
+	
+	void release(Piece *piece) {
+		if (piece == NULL) return;
+		if (m_arena != NULL) m_arena->release(piece);
+		else delete piece;
+	}
+	
+	void toggle(const Piece *piece, const Point& pos) {
+		m_key ^= zobrist( piece_index(piece) * 64 + pos.index() );
+	}
+	
+	void capture(Piece *piece, const Point& pos) {
+		if (piece == NULL) return;
+		toggle(piece, pos);
+		--m_counts[ piece_index(piece) ];
+		release(piece);
+	}
+	
+	void record() {
+		if (m_halfmove == 0) m_history_size = 0;
+		if (m_history_size < (int) (sizeof m_history / sizeof m_history[0]))
+			m_history[m_history_size++] = hash();
+	}
+	
+	// Recomputes the placement key and material counts from the board.
+	void rehash() {
+		m_key = 0;
+		memset(m_counts, 0, sizeof m_counts);
+		for (int i = 0; i < 8; ++i) {
+			for (int j = 0; j < 8; ++j) {
+				Piece *piece = m_board->get( Point(i, j) );
+				if (piece == NULL) continue;
+				toggle( piece, Point(i, j) );
+				++m_counts[ piece_index(piece) ];
+			}
+		}
+		m_history_size = 0;
+		record();
+	}
+	
+	static char *write_number(char *p, int n) {
+		char digits[12];
+		int len = 0;
+		do {
+			digits[len++] = (char) ('0' + n % 10);
+			n /= 10;
+		} while (n > 0);
+		while (len > 0) *p++ = digits[--len];
+		return p;
+	}
+	
+	// Puts a new piece on an empty square of the arena board. Pawns off their
+	// starting rank, rooks and kings count as moved until restore_rights().
+	// Returns NULL for a second king of a colour or a 33rd piece.
+	Piece *place(int type, int color, const Point& pos) {
+		if ( m_arena->full() ) return NULL;
+		Piece *piece;
+		switch (type) {
+			case Piece::PAWN: {
+				Pawn *pawn = m_arena->create<Pawn>(color);
+				pawn->moved( pos.x() != (color == WHITE ? 6 : 1) );
+				piece = pawn;
+				break;
+			}
+			case Piece::KNIGHT: piece = m_arena->create<Knight>(color); break;
+			case Piece::BISHOP: piece = m_arena->create<Bishop>(color); break;
+			case Piece::ROOK: {
+				Rook *rook = m_arena->create<Rook>(color);
+				rook->moved(true);
+				piece = rook;
+				break;
+			}
+			case Piece::QUEEN: piece = m_arena->create<Queen>(color); break;
+			case Piece::KING:
+				if (m_kings[color] != NULL) return NULL;
+				piece = m_kings[color] = m_arena->create<King>(color);
+				m_kings[color]->moved(true);
+				break;
+			default: return NULL;
+		}
+		m_board->set(pos, piece);
+		return piece;
+	}
+	
+	void restore_rights(int rights) {
+		int king = Rules::king_file();
+		int kingside = Rules::rook_file(CASTLING_KINGSIDE), queenside = Rules::rook_file(CASTLING_QUEENSIDE);
+		unmove(rights, WHITE_KINGSIDE | WHITE_QUEENSIDE, Point(7, king));
+		unmove(rights, WHITE_KINGSIDE, Point(7, kingside));
+		unmove(rights, WHITE_QUEENSIDE, Point(7, queenside));
+		unmove(rights, BLACK_KINGSIDE | BLACK_QUEENSIDE, Point(0, king));
+		unmove(rights, BLACK_KINGSIDE, Point(0, kingside));
+		unmove(rights, BLACK_QUEENSIDE, Point(0, queenside));
+	}
+	
+	// The standard game writes castling as the king's two-square step, and
+	// Chess960 as the king moving onto its rook.
+	Move castling_move(int side) const {
+		int rank = (m_turn == WHITE) ? 7 : 0;
+		int to = Rules::SHUFFLED ? Rules::rook_file(side) : (side == CASTLING_QUEENSIDE ? 2 : 6);
+		return Move( Point(rank, Rules::king_file()), Point(rank, to), Move::CASTLING );
+	}
+	
+	void unmove(int rights, int mask, const Point& pos) {
+		if ( !(rights & mask) ) return;
+		Piece *piece = m_board->get(pos);
+		if (piece == NULL) return;
+		if (piece->type() == Piece::ROOK) static_cast<Rook*>(piece)->moved(false);
+		else if (piece->type() == Piece::KING) static_cast<King*>(piece)->moved(false);
+	}
+	
+	int add_move(Move *moves, int n, const Point& from, const Point& to) {
+		if ( !to.in_range() ) return n;
+		int status = validate(from, to);
+		if (status <= 0) return n;
+		if (status == 4) {
+			for (int kind = Move::KNIGHT; kind <= Move::QUEEN; ++kind)
+				moves[n++] = Move(from, to, kind);
+		} else {
+			moves[n++] = Move(from, to);
+		}
+		return n;
+	}
+	
+	int add_slides(Move *moves, int n, const Point& from, const Point *steps, int count) {
+		for (int i = 0; i < count; ++i) {
+			for (Point p = from + steps[i]; p.in_range(); p += steps[i]) {
+				n = add_move(moves, n, from, p);
+				if (m_board->get(p) != NULL) break;
+			}
+		}
+		return n;
+	}
+	
+	bool unmoved(const Point& pos, int type) const {
+		Piece *piece = m_board->get(pos);
+		if (piece == NULL || piece->type() != type) return false;
+		if ( piece->color() != (pos.x() == 7 ? WHITE : BLACK) ) return false;
+		if (type == Piece::KING) return !static_cast<King*>(piece)->moved();
+		return !static_cast<Rook*>(piece)->moved();
+	}
 };
 
+typedef BasicChess<StandardRules> Chess;
+typedef BasicChess<Chess960Rules> Chess960;
+
 /*void to_string(Piece *piece, char *str) {
 	if (piece == NULL) {
 		str[0] = '['; str[1] = ']';
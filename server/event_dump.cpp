@@ -0,0 +1,112 @@
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "event_log.hpp"
+
+using namespace std;
+
+static const char *s_names[] = {
+	"-", "accept", "request", "validated", "broadcast", "game_over", "close", "dropped"
+};
+
+// The events of one request, in nanoseconds since the request was read.
+struct Trace {
+	uint64_t	request;
+	int64_t		validated;
+	int64_t		broadcast;
+	int			fd;
+	int			status;
+	string		text;
+};
+
+static string text(const Event& event) {
+	return string( event.text, strnlen(event.text, sizeof event.text) );
+}
+
+static void dump(const vector<Event>& events) {
+	uint64_t start = events.empty() ? 0 : events[0].time;
+	for (size_t i = 0; i < events.size(); ++i) {
+		const Event& e = events[i];
+		const char *name = (e.type < sizeof s_names / sizeof s_names[0]) ? s_names[e.type] : "?";
+		printf( "%.6f\t%s\t%d\t%u\t%d\t%s\n", (e.time - start) / 1e9, name, e.fd, e.trace, e.value,
+			text(e).c_str() );
+	}
+}
+
+// One line per request with the time it took to validate and to answer,
+// then percentiles of the total over all requests that reached the engine.
+static void traces(const vector<Event>& events) {
+	map<uint32_t, Trace> traces;
+	for (size_t i = 0; i < events.size(); ++i) {
+		const Event& e = events[i];
+		if (e.trace == 0) continue;
+		Trace& trace = traces[e.trace];
+		if (e.type == EVENT_REQUEST) {
+			trace.request = e.time;
+			trace.validated = trace.broadcast = -1;
+			trace.fd = e.fd;
+			trace.status = 0;
+			trace.text = text(e);
+		} else if (e.type == EVENT_VALIDATED) {
+			trace.validated = e.time;
+			trace.status = e.value;
+		} else if (e.type == EVENT_BROADCAST) {
+			trace.broadcast = e.time;
+		}
+	}
+	printf("trace\tfd\trequest\tstatus\tvalidate_us\tbroadcast_us\ttotal_us\n");
+	vector<double> totals;
+	for (map<uint32_t, Trace>::iterator it = traces.begin(); it != traces.end(); ++it) {
+		const Trace& t = it->second;
+		if (t.validated < 0 || t.broadcast < 0) continue;
+		double validate = (t.validated - (int64_t) t.request) / 1e3;
+		double broadcast = (t.broadcast - t.validated) / 1e3;
+		double total = (t.broadcast - (int64_t) t.request) / 1e3;
+		printf( "%u\t%d\t%s\t%d\t%.1f\t%.1f\t%.1f\n", it->first, t.fd, t.text.c_str(), t.status,
+			validate, broadcast, total );
+		totals.push_back(total);
+	}
+	if ( totals.empty() ) return;
+	sort( totals.begin(), totals.end() );
+	fprintf(stderr, "%zu requests: p50 %.1f us, p99 %.1f us, max %.1f us\n", totals.size(),
+		totals[totals.size() / 2], totals[totals.size() * 99 / 100], totals.back());
+}
+
+int main(int argc, char *argv[]) {
+	bool trace = false;
+	int opt;
+	while ( (opt = getopt(argc, argv, "t")) != -1 ) {
+		if (opt == 't') trace = true;
+		else break;
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-t] events.log\n", argv[0]);
+		return 1;
+	}
+	FILE *in = fopen(argv[optind], "rb");
+	if (in == NULL) {
+		fprintf(stderr, "%s: cannot open\n", argv[optind]);
+		return 1;
+	}
+	char magic[sizeof s_event_log_magic];
+	if ( fread(magic, sizeof magic, 1, in) != 1 || memcmp(magic, s_event_log_magic, sizeof magic) != 0 ) {
+		fprintf(stderr, "%s: not an event log\n", argv[optind]);
+		fclose(in);
+		return 1;
+	}
+	vector<Event> events;
+	Event event;
+	while (fread(&event, sizeof event, 1, in) == 1) events.push_back(event);
+	fclose(in);
+	// Rings are drained one after the other, so put the threads back in order.
+	stable_sort( events.begin(), events.end(), [](const Event& a, const Event& b) { return a.time < b.time; } );
+
+	if (trace) traces(events);
+	else dump(events);
+	return 0;
+}
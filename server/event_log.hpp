@@ -0,0 +1,179 @@
+#ifndef EVENT_LOG_HPP
+#define EVENT_LOG_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// One fixed-size binary record. Events caused by the same request share a
+// trace number; text holds the start of the request, NUL-padded.
+struct Event {
+	uint64_t	time;
+	uint32_t	trace;
+	uint16_t	type;
+	int16_t		fd;
+	int32_t		value;
+	char		text[12];
+};
+
+enum {
+	EVENT_ACCEPT = 1,		// fd connected
+	EVENT_REQUEST = 2,		// message read from fd
+	EVENT_VALIDATED = 3,	// value: status returned by Chess::enter_move
+	EVENT_BROADCAST = 4,	// replies to the request written
+	EVENT_GAME_OVER = 5,	// value: Chess::status()
+	EVENT_CLOSE = 6,		// fd disconnected
+	EVENT_DROPPED = 7		// value: events lost to full rings since the last one
+};
+
+// A log file is this magic followed by Events in the order they were drained:
+// in time order per thread, interleaved between threads.
+static const char s_event_log_magic[8] = "CHLOG1";
+
+// Written by one thread and read by the drain thread, without locks.
+class EventRing {
+	static const uint32_t s_size = 4096;
+	Event				m_events[s_size];
+	atomic<uint32_t>	m_head;
+	atomic<uint32_t>	m_tail;
+
+public:
+	atomic<uint32_t>	dropped;
+
+	EventRing() : m_head(0), m_tail(0), dropped(0) {}
+
+	bool push(const Event& event) {
+		uint32_t head = m_head.load(memory_order_relaxed);
+		if ( head - m_tail.load(memory_order_acquire) == s_size ) {
+			dropped.fetch_add(1, memory_order_relaxed);
+			return false;
+		}
+		m_events[head % s_size] = event;
+		m_head.store(head + 1, memory_order_release);
+		return true;
+	}
+
+	size_t drain(FILE *out) {
+		uint32_t tail = m_tail.load(memory_order_relaxed);
+		uint32_t head = m_head.load(memory_order_acquire);
+		size_t n = head - tail;
+		while (tail != head) {
+			uint32_t i = tail % s_size;
+			uint32_t run = min(head - tail, s_size - i);
+			fwrite(&m_events[i], sizeof(Event), run, out);
+			tail += run;
+		}
+		m_tail.store(tail, memory_order_release);
+		return n;
+	}
+};
+
+// log() only stamps the event and copies it into the calling thread's ring;
+// a background thread moves the rings to the file every s_interval_ms. A
+// thread that fills its ring before the next drain loses events, which the
+// log records as EVENT_DROPPED. Only one EventLog may be open at a time.
+class EventLog {
+	static const int s_interval_ms = 20;
+	FILE				*m_out;
+	uint32_t			m_generation;
+	atomic<bool>		m_running;
+	mutex				m_lock;
+	vector<EventRing*>	m_rings;
+	thread				m_drain;
+
+public:
+	EventLog() : m_out(NULL), m_generation(0), m_running(false) {}
+	~EventLog() { close(); }
+
+	bool open(const char *path) {
+		close();
+		m_out = fopen(path, "wb");
+		if (m_out == NULL) return false;
+		fwrite(s_event_log_magic, sizeof s_event_log_magic, 1, m_out);
+		m_generation = generation()++;
+		m_running.store(true, memory_order_release);
+		m_drain = thread( [this]() {
+			while ( m_running.load(memory_order_acquire) ) {
+				this_thread::sleep_for( chrono::milliseconds(s_interval_ms) );
+				drain();
+			}
+		} );
+		return true;
+	}
+
+	void close() {
+		if ( !m_running.exchange(false) ) return;
+		m_drain.join();
+		drain();
+		fclose(m_out);
+		m_out = NULL;
+		for (size_t i = 0; i < m_rings.size(); ++i) delete m_rings[i];
+		m_rings.clear();
+	}
+
+	void log(int type, int fd, uint32_t trace, int32_t value = 0, const char *text = NULL) {
+		if ( !m_running.load(memory_order_relaxed) ) return;
+		Event event;
+		event.time = now();
+		event.trace = trace;
+		event.type = (uint16_t) type;
+		event.fd = (int16_t) fd;
+		event.value = value;
+		memset(event.text, 0, sizeof event.text);
+		if (text != NULL) memcpy( event.text, text, strnlen(text, sizeof event.text) );
+		ring()->push(event);
+	}
+
+	// CLOCK_MONOTONIC in nanoseconds.
+	static uint64_t now() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+private:
+	// Each open() starts a new generation, so a thread never reuses a ring
+	// that an earlier close() freed.
+	static atomic<uint32_t>& generation() {
+		static atomic<uint32_t> s_generation(1);
+		return s_generation;
+	}
+
+	EventRing *ring() {
+		static thread_local EventRing *t_ring = NULL;
+		static thread_local uint32_t t_generation = 0;
+		if (t_generation == m_generation) return t_ring;
+		t_ring = new EventRing();
+		t_generation = m_generation;
+		lock_guard<mutex> guard(m_lock);
+		m_rings.push_back(t_ring);
+		return t_ring;
+	}
+
+	void drain() {
+		lock_guard<mutex> guard(m_lock);
+		for (size_t i = 0; i < m_rings.size(); ++i) {
+			m_rings[i]->drain(m_out);
+			uint32_t dropped = m_rings[i]->dropped.exchange(0, memory_order_relaxed);
+			if (dropped == 0) continue;
+			Event event;
+			memset(&event, 0, sizeof event);
+			event.time = now();
+			event.type = EVENT_DROPPED;
+			event.value = (int32_t) dropped;
+			fwrite(&event, sizeof event, 1, m_out);
+		}
+		fflush(m_out);
+	}
+};
+
+#endif
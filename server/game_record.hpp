@@ -0,0 +1,70 @@
+#ifndef GAME_RECORD_HPP
+#define GAME_RECORD_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "chess.hpp"
+
+using namespace std;
+
+enum { VARIANT_STANDARD = 0, VARIANT_CHESS960 = 1 };
+
+// Everything the server keeps about a game between two of its moves. Arrays
+// indexed by colour use Chess::WHITE and Chess::BLACK.
+struct GameRecord {
+	enum { RECENT = 12 };
+	Chess::Packed	position;
+	uint64_t		recent[RECENT];	// the end of Chess::history(), the rest is in History
+	int64_t			last_move;		// monotonic_us() when the clock last switched
+	int32_t			players[2];		// fds
+	int32_t			clocks[2];		// milliseconds left, if timed
+	uint32_t		history;		// History node of the last ply
+	uint16_t		ply;
+	uint16_t		pending;		// Move::code() of a promotion waiting for its piece
+	uint16_t		start;			// Chess960 start position, for VARIANT_CHESS960
+	uint8_t			recent_size;
+	uint8_t			timed;
+	uint8_t			in_use;
+	uint8_t			result;			// 0-1, draw and 1-0 as 0, 1 and 2 once the game is over
+	uint8_t			variant;		// the rules engine the position is unpacked with
+};
+
+static_assert(sizeof(GameRecord) <= 256, "a game record must stay under 256 bytes");
+
+// Game records in one contiguous vector. Ids of released records are reused
+// before the vector grows, so an id is only valid until release().
+class GameSlab {
+	vector<GameRecord>	m_records;
+	vector<uint32_t>	m_free;
+
+public:
+	static const uint32_t NONE = UINT32_MAX;
+
+	uint32_t create() {
+		uint32_t id;
+		if ( m_free.empty() ) {
+			id = (uint32_t) m_records.size();
+			m_records.resize(id + 1);
+		} else {
+			id = m_free.back();
+			m_free.pop_back();
+		}
+		memset(&m_records[id], 0, sizeof m_records[id]);
+		m_records[id].in_use = 1;
+		return id;
+	}
+
+	void release(uint32_t id) {
+		m_records[id].in_use = 0;
+		m_free.push_back(id);
+	}
+
+	GameRecord& operator[](uint32_t id) { return m_records[id]; }
+
+	// Ids run from 0 to capacity() - 1, in use or not.
+	uint32_t capacity() const { return (uint32_t) m_records.size(); }
+	uint32_t size() const { return (uint32_t) (m_records.size() - m_free.size()); }
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A hot restart moves a running server's sockets and games to a new
+// process over a Unix socket: the old process writes its state as one
+// length-prefixed blob, then passes its listening socket and client
+// connections with SCM_RIGHTS, and exits once the new process has
+// acknowledged them with one byte.
+static const char s_handoff_magic[8] = { 'C', 'H', 'H', 'O', 'F', 'F', '1', '\0' };
+
+// File descriptors per SCM_RIGHTS message, well under the kernel's limit.
+static const size_t s_handoff_fds = 64;
+
+inline bool handoff_write(int sock, const void *data, size_t size) {
+	const char *p = static_cast<const char*>(data);
+	while (size > 0) {
+		ssize_t n = write(sock, p, size);
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+inline bool handoff_read(int sock, void *data, size_t size) {
+	char *p = static_cast<char*>(data);
+	while (size > 0) {
+		ssize_t n = read(sock, p, size);
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+inline bool handoff_send_fds(int sock, const vector<int>& fds) {
+	for (size_t first = 0; first < fds.size(); first += s_handoff_fds) {
+		size_t n = min(s_handoff_fds, fds.size() - first);
+		char byte = 0;
+		struct iovec iov = { &byte, 1 };
+		char control[CMSG_SPACE(sizeof(int) * s_handoff_fds)];
+		memset(control, 0, sizeof control);
+		struct msghdr msg;
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+		memcpy(CMSG_DATA(cmsg), &fds[first], sizeof(int) * n);
+		if (sendmsg(sock, &msg, 0) != 1) return false;
+	}
+	return true;
+}
+
+inline bool handoff_recv_fds(int sock, size_t count, vector<int>& fds) {
+	fds.clear();
+	while (fds.size() < count) {
+		size_t n = min(s_handoff_fds, count - fds.size());
+		char byte;
+		struct iovec iov = { &byte, 1 };
+		char control[CMSG_SPACE(sizeof(int) * s_handoff_fds)];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+		if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) return false;
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if ( cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * n) ) return false;
+		size_t first = fds.size();
+		fds.resize(first + n);
+		memcpy(&fds[first], CMSG_DATA(cmsg), sizeof(int) * n);
+	}
+	return true;
+}
+
+// Opens a Unix stream socket at path, listening if listen is set and
+// connecting otherwise. Returns -1 on failure.
+inline int handoff_socket(const char *path, bool listen) {
+	struct sockaddr_un sa;
+	if ( strlen(path) >= sizeof sa.sun_path ) return -1;
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	if (listen) {
+		unlink(path);
+		if ( bind(fd, (struct sockaddr*) &sa, sizeof sa) == 0 && ::listen(fd, 1) == 0 ) return fd;
+	} else if ( connect(fd, (struct sockaddr*) &sa, sizeof sa) == 0 ) {
+		return fd;
+	}
+	close(fd);
+	return -1;
+}
+
+// The state blob: fixed-size values in host byte order, since both ends
+// are builds of the same server on the same machine.
+class HandoffWriter {
+	vector<uint8_t>	m_data;
+
+public:
+	template <class T> void put(const T& value) {
+		const uint8_t *p = reinterpret_cast<const uint8_t*>(&value);
+		m_data.insert(m_data.end(), p, p + sizeof value);
+	}
+
+	void put_string(const string& text) {
+		put<uint32_t>( (uint32_t) text.size() );
+		m_data.insert( m_data.end(), text.begin(), text.end() );
+	}
+
+	const vector<uint8_t>& data() const { return m_data; }
+};
+
+class HandoffReader {
+	const uint8_t	*m_p;
+	const uint8_t	*m_end;
+
+public:
+	HandoffReader(const vector<uint8_t>& data) {
+		m_p = data.data();
+		m_end = m_p + data.size();
+	}
+
+	template <class T> bool get(T& value) {
+		if ( (size_t) (m_end - m_p) < sizeof value ) return false;
+		memcpy(&value, m_p, sizeof value);
+		m_p += sizeof value;
+		return true;
+	}
+
+	bool get_string(string& text) {
+		uint32_t size;
+		if ( !get(size) || (size_t) (m_end - m_p) < size ) return false;
+		text.assign( reinterpret_cast<const char*>(m_p), size );
+		m_p += size;
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef HASH_RING_HPP
+#define HASH_RING_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Consistent hashing of 64-bit keys onto named nodes. Each node owns
+// s_replicas points of the ring and a key goes to the first point at or
+// after its hash, so adding or removing one of n nodes moves about 1/n of
+// the keys and leaves the rest where they were.
+class HashRing {
+	static const int s_replicas = 64;
+	vector< pair<uint64_t, int> >	m_points;
+	vector<string>					m_nodes;
+
+public:
+	static uint64_t mix(uint64_t x) {
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+
+	static uint64_t hash(const string& text) {
+		uint64_t h = 0xcbf29ce484222325ULL;
+		for (size_t i = 0; i < text.size(); ++i) h = (h ^ (uint8_t) text[i]) * 0x100000001b3ULL;
+		return mix(h);
+	}
+
+	void set(const vector<string>& nodes) {
+		m_nodes = nodes;
+		m_points.clear();
+		for (size_t n = 0; n < nodes.size(); ++n)
+			for (int r = 0; r < s_replicas; ++r)
+				m_points.push_back( make_pair(hash(nodes[n] + "#" + to_string(r)), (int) n) );
+		sort( m_points.begin(), m_points.end() );
+	}
+
+	// The nodes in the order key should try them: its owner, then each other
+	// node as the ring meets it, for when the owner cannot be reached.
+	void candidates(uint64_t key, vector<int>& order) const {
+		order.clear();
+		if ( m_points.empty() ) return;
+		size_t i = lower_bound( m_points.begin(), m_points.end(), make_pair(mix(key), -1) ) - m_points.begin();
+		for (size_t n = 0; n < m_points.size() && order.size() < m_nodes.size(); ++n) {
+			int node = m_points[(i + n) % m_points.size()].second;
+			if (find(order.begin(), order.end(), node) == order.end()) order.push_back(node);
+		}
+	}
+
+	const string& node(int i) const { return m_nodes[i]; }
+	size_t size() const { return m_nodes.size(); }
+};
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef HISTORY_HPP
+#define HISTORY_HPP
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "chess.hpp"
+
+using namespace std;
+
+// The moves of every game on a server, as one trie of plies rooted at the
+// starting position, or one trie per start position for variants like
+// Chess960. A game holds a reference to the node of its last ply,
+// and games that opened the same way share the nodes of their common
+// prefix, so memory grows with distinct plies rather than with plies
+// played. Every node keeps the hash() of its position for the repetition
+// check, and nodes at a multiple of s_interval plies a packed copy of it,
+// so reaching any ply replays fewer than s_interval moves.
+class History {
+	static const int s_interval = 16;
+	static const uint32_t NONE = UINT32_MAX;
+	struct Node {
+		uint32_t	parent;
+		uint32_t	child;		// first child
+		uint32_t	sibling;	// next child of parent, or next free node
+		uint32_t	refs;		// games ending here plus children
+		uint32_t	keyframe;
+		uint64_t	key;		// hash() of the position
+		uint16_t	move;
+		uint16_t	depth;
+	};
+	vector<Node>			m_nodes;
+	vector<Chess::Packed>	m_keyframes;
+	vector<uint32_t>		m_free_keyframes;
+	unordered_map<uint64_t, uint32_t>	m_roots;	// by the start position's hash()
+	uint32_t				m_free;
+	size_t					m_size;
+
+public:
+	static const uint32_t ROOT = 0;
+
+	History() {
+		Chess start;
+		start.setup();
+		m_free = NONE;
+		m_size = 1;
+		m_nodes.resize(1);
+		Node& root = m_nodes[ROOT];
+		root.parent = root.child = root.sibling = NONE;
+		root.refs = 1;
+		root.move = 0;
+		root.depth = 0;
+		root.key = start.hash();
+		root.keyframe = add_keyframe(start);
+		m_roots[ start.hash() ] = ROOT;
+	}
+
+	// The node games from start begin at: ROOT for the standard start, and
+	// for any other a root of its own, made on first use and never freed.
+	template <class Engine> uint32_t root(const Engine& start) {
+		uint64_t key = start.hash();
+		unordered_map<uint64_t, uint32_t>::const_iterator it = m_roots.find(key);
+		if ( it != m_roots.end() ) return it->second;
+		uint32_t node = allocate();
+		Node& n = m_nodes[node];
+		n.parent = n.child = n.sibling = NONE;
+		n.refs = 1;
+		n.move = 0;
+		n.depth = 0;
+		n.key = key;
+		n.keyframe = add_keyframe(start);
+		m_roots[key] = node;
+		return node;
+	}
+
+	// Moves the caller's reference from node to the child reached by move;
+	// chess is the position the move led to.
+	template <class Engine> uint32_t push(uint32_t node, const Move& move, const Engine& chess) {
+		uint32_t child = m_nodes[node].child;
+		while (child != NONE && m_nodes[child].move != move.code()) child = m_nodes[child].sibling;
+		if (child != NONE) {
+			++m_nodes[child].refs;
+			release(node);
+			return child;
+		}
+		child = allocate();
+		Node& n = m_nodes[child];
+		n.parent = node;
+		n.child = NONE;
+		n.sibling = m_nodes[node].child;
+		n.refs = 1;
+		n.move = move.code();
+		n.depth = (uint16_t) (m_nodes[node].depth + 1);
+		n.key = chess.hash();
+		n.keyframe = (n.depth % s_interval == 0) ? add_keyframe(chess) : NONE;
+		m_nodes[node].child = child;
+		return child;
+	}
+
+	// Drops a reference to node, freeing the plies no other game shares.
+	void release(uint32_t node) {
+		while (m_nodes[node].parent != NONE && --m_nodes[node].refs == 0) {
+			uint32_t parent = m_nodes[node].parent;
+			uint32_t *link = &m_nodes[parent].child;
+			while (*link != node) link = &m_nodes[*link].sibling;
+			*link = m_nodes[node].sibling;
+			if (m_nodes[node].keyframe != NONE) m_free_keyframes.push_back(m_nodes[node].keyframe);
+			m_nodes[node].sibling = m_free;
+			m_free = node;
+			--m_size;
+			node = parent;
+		}
+	}
+
+	// Sets chess, which must have the game's rules, to the position after
+	// the first ply moves of the game ending at node.
+	template <class Engine> bool position(uint32_t node, int ply, Engine& chess) const {
+		if ( ply < 0 || ply > depth(node) ) return false;
+		while (m_nodes[node].depth > ply) node = m_nodes[node].parent;
+		uint16_t moves[s_interval];
+		int n = 0;
+		for (; m_nodes[node].keyframe == NONE; node = m_nodes[node].parent) moves[n++] = m_nodes[node].move;
+		chess.unpack(m_keyframes[ m_nodes[node].keyframe ]);
+		while (n > 0) chess.enter_move( Move::from_code(moves[--n]) );
+		return true;
+	}
+
+	// The moves of the game ending at node, first move first.
+	void moves(uint32_t node, vector<Move>& played) const {
+		played.resize( depth(node) );
+		for (; m_nodes[node].depth > 0; node = m_nodes[node].parent)
+			played[ m_nodes[node].depth - 1 ] = Move::from_code(m_nodes[node].move);
+	}
+	
+	// Copies the hash() of the last n positions of the game ending at node,
+	// oldest first, as Chess::history() would, and returns how many it
+	// copied: fewer than n if the game is shorter.
+	int keys(uint32_t node, int n, uint64_t *keys) const {
+		n = min(n, depth(node) + 1);
+		for (int i = n - 1; i >= 0; --i, node = m_nodes[node].parent) keys[i] = m_nodes[node].key;
+		return n;
+	}
+	
+	int depth(uint32_t node) const { return m_nodes[node].depth; }
+	// Nodes in use, the root included.
+	size_t size() const { return m_size; }
+
+private:
+	uint32_t allocate() {
+		++m_size;
+		if (m_free == NONE) {
+			m_nodes.resize(m_nodes.size() + 1);
+			return (uint32_t) m_nodes.size() - 1;
+		}
+		uint32_t node = m_free;
+		m_free = m_nodes[node].sibling;
+		return node;
+	}
+
+	template <class Engine> uint32_t add_keyframe(const Engine& chess) {
+		uint32_t keyframe;
+		if ( m_free_keyframes.empty() ) {
+			keyframe = (uint32_t) m_keyframes.size();
+			m_keyframes.resize(keyframe + 1);
+		} else {
+			keyframe = m_free_keyframes.back();
+			m_free_keyframes.pop_back();
+		}
+		chess.pack(m_keyframes[keyframe]);
+		return keyframe;
+	}
+};
+
+#endif
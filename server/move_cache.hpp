@@ -0,0 +1,131 @@
+#ifndef MOVE_CACHE_HPP
+#define MOVE_CACHE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include "chess.hpp"
+
+using namespace std;
+
+// The legal moves of a position, in Chess::legal_moves() order, and what
+// follows from the position alone.
+struct LegalMoves {
+	int		count;
+	bool	check;
+	int		status;		// IN_PROGRESS, CHECKMATE, STALEMATE or INSUFFICIENT_MATERIAL
+	Move	moves[Chess::MAX_MOVES];
+
+	template <class Engine> void generate(Engine& chess) {
+		count = chess.legal_moves(moves);
+		check = chess.in_check() != 0;
+		if ( chess.insufficient_material() ) status = Chess::INSUFFICIENT_MATERIAL;
+		else if (count == 0) status = check ? Chess::CHECKMATE : Chess::STALEMATE;
+		else status = Chess::IN_PROGRESS;
+	}
+
+	// Chess::status() of chess, whose position these moves are for.
+	template <class Engine> int game_status(const Engine& chess) const {
+		return (status != Chess::IN_PROGRESS) ? status : chess.history_status();
+	}
+
+	// Whether a move between the same squares is legal. Clients name
+	// promotions and castling by their squares, so the kind is left out.
+	bool contains(const Move& move) const {
+		for (int i = 0; i < count; ++i)
+			if (moves[i].from() == move.from() && moves[i].to() == move.to()) return true;
+		return false;
+	}
+};
+
+// LegalMoves by Zobrist key, in a fixed amount of memory shared by any
+// number of threads. The table is split into shards by the top bits of the
+// key, each behind its own lock, so threads rarely meet; within a shard a
+// key has one slot and a new position takes it over from the old one.
+// Positions with more than s_entry_moves moves are not kept.
+class MoveCache {
+	static const int s_shards = 64;
+	static const int s_entry_moves = 80;
+	struct Entry {
+		uint64_t	key;
+		uint8_t		used;
+		uint8_t		count;
+		uint8_t		check;
+		uint8_t		status;
+		uint16_t	moves[s_entry_moves];
+	};
+	struct Shard {
+		mutex			lock;
+		vector<Entry>	entries;
+		uint64_t		hits;
+		uint64_t		misses;
+	};
+	Shard		m_shards[s_shards];
+	uint64_t	m_mask;
+
+public:
+	MoveCache(size_t megabytes) {
+		uint64_t size = 1;
+		while (size * 2 * sizeof(Entry) * s_shards <= megabytes << 20) size *= 2;
+		Entry empty;
+		memset(&empty, 0, sizeof empty);
+		for (int i = 0; i < s_shards; ++i) {
+			m_shards[i].entries.assign( (megabytes == 0) ? 0 : size, empty );
+			m_shards[i].hits = m_shards[i].misses = 0;
+		}
+		m_mask = size - 1;
+	}
+
+	// Fills legal for chess's position, from the cache if it has it. Keys
+	// of different variants differ, so games of several share one cache.
+	template <class Engine> void get(Engine& chess, LegalMoves& legal) {
+		uint64_t key = chess.hash();
+		if ( probe(key, legal) ) return;
+		legal.generate(chess);
+		store(key, legal);
+	}
+
+	bool probe(uint64_t key, LegalMoves& legal) {
+		Shard& shard = m_shards[key >> 58];
+		lock_guard<mutex> hold(shard.lock);
+		if ( shard.entries.empty() ) return false;
+		const Entry& entry = shard.entries[key & m_mask];
+		if (!entry.used || entry.key != key) {
+			++shard.misses;
+			return false;
+		}
+		++shard.hits;
+		legal.count = entry.count;
+		legal.check = entry.check != 0;
+		legal.status = entry.status;
+		for (int i = 0; i < entry.count; ++i) legal.moves[i] = Move::from_code(entry.moves[i]);
+		return true;
+	}
+
+	void store(uint64_t key, const LegalMoves& legal) {
+		if (legal.count > s_entry_moves) return;
+		Shard& shard = m_shards[key >> 58];
+		lock_guard<mutex> hold(shard.lock);
+		if ( shard.entries.empty() ) return;
+		Entry& entry = shard.entries[key & m_mask];
+		entry.key = key;
+		entry.used = 1;
+		entry.count = (uint8_t) legal.count;
+		entry.check = legal.check;
+		entry.status = (uint8_t) legal.status;
+		for (int i = 0; i < legal.count; ++i) entry.moves[i] = legal.moves[i].code();
+	}
+
+	// Probes that found their position, and probes that did not.
+	void stats(uint64_t& hits, uint64_t& misses) {
+		hits = misses = 0;
+		for (int i = 0; i < s_shards; ++i) {
+			lock_guard<mutex> hold(m_shards[i].lock);
+			hits += m_shards[i].hits;
+			misses += m_shards[i].misses;
+		}
+	}
+};
+
+#endif
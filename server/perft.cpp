@@ -0,0 +1,300 @@
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "chess.hpp"
+
+using namespace std;
+
+// Shared by all threads without locks: an entry stores key ^ nodes next to
+// nodes, so a torn read of a concurrently written entry fails the key test
+// and counts as a miss.
+class PerftTable {
+	struct Entry {
+		atomic<uint64_t>	check;
+		atomic<uint64_t>	nodes;
+	};
+	Entry		*m_entries;
+	uint64_t	m_mask;
+
+public:
+	PerftTable(size_t megabytes) {
+		uint64_t size = 1;
+		while (size * 2 * sizeof(Entry) <= megabytes << 20) size *= 2;
+		m_entries = (megabytes == 0) ? NULL : new Entry[size];
+		m_mask = size - 1;
+		for (uint64_t i = 0; m_entries != NULL && i <= m_mask; ++i) {
+			m_entries[i].check.store(0, memory_order_relaxed);
+			m_entries[i].nodes.store(0, memory_order_relaxed);
+		}
+	}
+	~PerftTable() { delete[] m_entries; }
+
+	bool probe(uint64_t key, int depth, uint64_t& nodes) const {
+		if (m_entries == NULL) return false;
+		key ^= Chess::zobrist(1024 + depth);
+		const Entry& entry = m_entries[key & m_mask];
+		uint64_t check = entry.check.load(memory_order_relaxed);
+		uint64_t value = entry.nodes.load(memory_order_relaxed);
+		if ( (check ^ value) != key ) return false;
+		nodes = value;
+		return true;
+	}
+
+	void store(uint64_t key, int depth, uint64_t nodes) {
+		if (m_entries == NULL) return;
+		key ^= Chess::zobrist(1024 + depth);
+		Entry& entry = m_entries[key & m_mask];
+		entry.check.store(key ^ nodes, memory_order_relaxed);
+		entry.nodes.store(nodes, memory_order_relaxed);
+	}
+};
+
+// One copy of the position per ply, reused for every node at that ply, so
+// the search itself does not allocate.
+template <class Engine>
+class Perft {
+	static const int s_max_depth = 32;
+	Engine		m_stack[s_max_depth];
+	PerftTable	*m_table;
+
+public:
+	Perft(PerftTable *table) { m_table = table; }
+
+	uint64_t run(const Engine& chess, int depth) {
+		if (depth <= 0) return 1;
+		m_stack[0] = chess;
+		return search(0, depth);
+	}
+
+private:
+	uint64_t search(int ply, int depth) {
+		Engine& chess = m_stack[ply];
+		Move moves[Chess::MAX_MOVES];
+		int n = chess.legal_moves(moves);
+		if (depth == 1) return n;
+		uint64_t key = chess.hash();
+		uint64_t nodes = 0;
+		if ( m_table->probe(key, depth, nodes) ) return nodes;
+		for (int i = 0; i < n; ++i) {
+			m_stack[ply + 1] = chess;
+			m_stack[ply + 1].enter_move(moves[i]);
+			nodes += search(ply + 1, depth - 1);
+		}
+		m_table->store(key, depth, nodes);
+		return nodes;
+	}
+};
+
+// Each thread owns a deque of tasks and works from its back; a thread that
+// runs dry steals from the front of the others.
+template <class Task>
+class WorkPool {
+	struct Queue {
+		mutex		lock;
+		deque<Task>	tasks;
+	};
+	vector<Queue>	m_queues;
+
+public:
+	WorkPool(int threads) : m_queues(threads) {}
+
+	void push(int queue, const Task& task) {
+		Queue& q = m_queues[queue % m_queues.size()];
+		lock_guard<mutex> guard(q.lock);
+		q.tasks.push_back(task);
+	}
+
+	bool pop(int self, Task& task) {
+		for (size_t i = 0; i < m_queues.size(); ++i) {
+			Queue& q = m_queues[(self + i) % m_queues.size()];
+			lock_guard<mutex> guard(q.lock);
+			if ( q.tasks.empty() ) continue;
+			if (i == 0) {
+				task = q.tasks.back();
+				q.tasks.pop_back();
+			} else {
+				task = q.tasks.front();
+				q.tasks.pop_front();
+			}
+			return true;
+		}
+		return false;
+	}
+
+	template <class Fn> void run(Fn fn) {
+		vector<thread> threads;
+		for (size_t t = 0; t < m_queues.size(); ++t) {
+			threads.push_back( thread([this, t, &fn]() {
+				Task task;
+				while ( pop(t, task) ) fn(t, task);
+			}) );
+		}
+		for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+	}
+};
+
+struct Split {
+	int		root;
+	int		reply;
+};
+
+// Splits the tree two plies below the root so there are enough tasks to
+// keep every thread busy, and prints the node count below each root move.
+template <class Engine>
+static uint64_t parallel_perft(const Engine& chess, int depth, int threads, PerftTable& table, bool divide) {
+	Engine root(chess);
+	Move moves[Chess::MAX_MOVES];
+	int n = root.legal_moves(moves);
+	if (depth <= 1) return depth <= 0 ? 1 : n;
+
+	vector<Engine> children(n, root);
+	vector< vector<Move> > replies(n);
+	vector< atomic<uint64_t> > counts(n);
+	WorkPool<Split> pool(threads);
+	int queued = 0;
+	for (int i = 0; i < n; ++i) {
+		counts[i].store(0);
+		children[i].enter_move(moves[i]);
+		Move buffer[Chess::MAX_MOVES];
+		int m = (depth > 2) ? children[i].legal_moves(buffer) : 0;
+		replies[i].assign(buffer, buffer + m);
+		if (m == 0) {
+			Split split = { i, -1 };
+			pool.push(queued++, split);
+		}
+		for (int j = 0; j < m; ++j) {
+			Split split = { i, j };
+			pool.push(queued++, split);
+		}
+	}
+
+	vector<Perft<Engine>*> workers;
+	for (int t = 0; t < threads; ++t) workers.push_back( new Perft<Engine>(&table) );
+	pool.run( [&](int t, const Split& split) {
+		Engine position(children[split.root]);
+		if (split.reply < 0) {
+			counts[split.root] += workers[t]->run(position, depth - 1);
+			return;
+		}
+		position.enter_move(replies[split.root][split.reply]);
+		counts[split.root] += workers[t]->run(position, depth - 2);
+	} );
+	for (int t = 0; t < threads; ++t) delete workers[t];
+
+	uint64_t total = 0;
+	for (int i = 0; i < n; ++i) {
+		if (divide) {
+			char str[8];
+			moves[i].to_string(str);
+			printf( "%s: %llu\n", str, (unsigned long long) counts[i].load() );
+		}
+		total += counts[i];
+	}
+	return total;
+}
+
+// Batch mode: one FEN per line, positions spread over the threads; each
+// line of output is the FEN, its legal move count, whether the side to move
+// is in check, and the perft count at the requested depth. Every line
+// is read with the rules of start, which must have been set up.
+template <class Engine>
+static int batch(const Engine& start, const char *path, int depth, int threads, PerftTable& table) {
+	FILE *in = fopen(path, "r");
+	if (in == NULL) {
+		fprintf(stderr, "%s: cannot open\n", path);
+		return 1;
+	}
+	vector<string> lines;
+	char line[256];
+	while ( fgets(line, sizeof line, in) ) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] != '\0' && line[0] != '#') lines.push_back(line);
+	}
+	fclose(in);
+
+	vector<string> results(lines.size());
+	WorkPool<size_t> pool(threads);
+	for (size_t i = 0; i < lines.size(); ++i) pool.push(i, i);
+	vector<Perft<Engine>*> workers;
+	for (int t = 0; t < threads; ++t) workers.push_back( new Perft<Engine>(&table) );
+	pool.run( [&](int t, size_t i) {
+		Engine chess(start);
+		if ( !chess.setup(lines[i].c_str()) ) {
+			results[i] = lines[i] + "\tinvalid";
+			return;
+		}
+		Move moves[Chess::MAX_MOVES];
+		int n = chess.legal_moves(moves);
+		bool check = chess.in_check() != 0;
+		uint64_t nodes = workers[t]->run(chess, depth);
+		results[i] = lines[i] + "\t" + to_string(n) + "\t" + (check ? "check" : "-") + "\t" + to_string(nodes);
+	} );
+	for (int t = 0; t < threads; ++t) delete workers[t];
+	for (size_t i = 0; i < results.size(); ++i) printf("%s\n", results[i].c_str());
+	return 0;
+}
+
+// Counts from fen, or from the start position of chess's rules if fen is NULL.
+template <class Engine>
+static int perft(Engine& chess, const char *fen, int depth, int threads, PerftTable& table, bool divide) {
+	if (fen == NULL) {
+		chess.setup();
+	} else if ( !chess.setup(fen) ) {
+		fprintf(stderr, "invalid FEN\n");
+		return 1;
+	}
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	uint64_t nodes = parallel_perft(chess, depth, threads, table, divide);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	printf( "perft %d: %llu (%.2f s, %.0f nodes/s)\n", depth, (unsigned long long) nodes, seconds,
+		seconds > 0 ? nodes / seconds : 0.0 );
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int depth = 5;
+	int threads = thread::hardware_concurrency();
+	size_t hash_mb = 64;
+	bool divide = false;
+	const char *batch_path = NULL;
+	int chess960 = -1;
+	int opt;
+	while ( (opt = getopt(argc, argv, "d:j:H:b:v9:")) != -1 ) {
+		if (opt == 'd') depth = atoi(optarg);
+		else if (opt == 'j') threads = atoi(optarg);
+		else if (opt == 'H') hash_mb = atoi(optarg);
+		else if (opt == 'b') batch_path = optarg;
+		else if (opt == 'v') divide = true;
+		else if (opt == '9') chess960 = atoi(optarg);
+		else {
+			fprintf(stderr, "usage: %s [-d depth] [-j threads] [-H hash_mb] [-v] [-9 start] [-b fens.txt | fen]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (threads < 1) threads = 1;
+	if (chess960 >= Chess960::POSITIONS) {
+		fprintf(stderr, "Chess960 start positions run from 0 to %d\n", Chess960::POSITIONS - 1);
+		return 1;
+	}
+	PerftTable table(hash_mb);
+	const char *fen = (optind < argc) ? argv[optind] : NULL;
+	if (chess960 >= 0) {
+		Chess960 chess;
+		chess.set_start(chess960);
+		chess.setup();
+		if (batch_path != NULL) return batch(chess, batch_path, depth, threads, table);
+		return perft(chess, fen, depth, threads, table, divide);
+	}
+	Chess chess;
+	chess.setup();
+	if (batch_path != NULL) return batch(chess, batch_path, depth, threads, table);
+	return perft(chess, fen, depth, threads, table, divide);
+}
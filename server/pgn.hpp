@@ -0,0 +1,271 @@
+#ifndef PGN_HPP
+#define PGN_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "chess.hpp"
+
+using namespace std;
+
+class PgnGame {
+	const char	*m_begin;
+	const char	*m_moves;
+	const char	*m_end;
+	const char	*m_cursor;
+
+public:
+	enum { BLACK_WINS = 0, DRAW = 1, WHITE_WINS = 2, UNKNOWN = -1 };
+
+	PgnGame() { m_begin = m_moves = m_end = m_cursor = NULL; }
+	PgnGame(const char *begin, const char *moves, const char *end) {
+		m_begin = begin; m_moves = moves; m_end = end; m_cursor = moves;
+	}
+
+	bool tag(const char *name, string& value) const {
+		size_t len = strlen(name);
+		for (const char *p = m_begin; p < m_moves; ++p) {
+			if (*p != '[') continue;
+			const char *q = p + 1;
+			if ( (size_t) (m_moves - q) <= len || strncmp(q, name, len) != 0 || q[len] != ' ' ) continue;
+			q += len;
+			while (q < m_moves && *q != '"') ++q;
+			const char *r = ++q;
+			while (r < m_moves && *r != '"') ++r;
+			if (r >= m_moves) return false;
+			value.assign(q, r);
+			return true;
+		}
+		return false;
+	}
+
+	int result() const {
+		string value;
+		if ( !tag("Result", value) ) return UNKNOWN;
+		if (value == "1-0") return WHITE_WINS;
+		if (value == "0-1") return BLACK_WINS;
+		if (value == "1/2-1/2") return DRAW;
+		return UNKNOWN;
+	}
+
+	// Copies the next SAN token of the main line into san, skipping move
+	// numbers, comments, variations, NAGs and the result marker.
+	bool next_move(char *san, size_t size) {
+		const char *p = m_cursor;
+		for (;;) {
+			while ( p < m_end && is_space(*p) ) ++p;
+			if (p >= m_end) break;
+			if (*p == '{') {
+				while (p < m_end && *p != '}') ++p;
+				++p;
+			} else if (*p == ';') {
+				while (p < m_end && *p != '\n') ++p;
+			} else if (*p == '(') {
+				int depth = 0;
+				for (; p < m_end; ++p) {
+					if (*p == '(') ++depth;
+					else if (*p == ')' && --depth == 0) break;
+				}
+				++p;
+			} else if (*p == ')') {
+				++p;
+			} else {
+				const char *q = p;
+				while ( q < m_end && !is_space(*q) && *q != '{' && *q != '(' && *q != ')' && *q != ';' ) ++q;
+				const char *token = p;
+				p = q;
+				if (*token == '$' || *token == '*' || is_result(token, q)) continue;
+				if ('1' <= *token && *token <= '9') {
+					while (token < q && '0' <= *token && *token <= '9') ++token;
+					while (token < q && *token == '.') ++token;
+					if (token == q) continue;
+				}
+				size_t len = q - token;
+				if (len >= size) len = size - 1;
+				memcpy(san, token, len);
+				san[len] = '\0';
+				m_cursor = q;
+				return true;
+			}
+		}
+		m_cursor = m_end;
+		return false;
+	}
+
+	void rewind() { m_cursor = m_moves; }
+	const char *begin() const { return m_begin; }
+	const char *end() const { return m_end; }
+
+private:
+	static bool is_space(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+	static bool is_result(const char *p, const char *q) {
+		size_t len = q - p;
+		return (len == 3 && (memcmp(p, "1-0", 3) == 0 || memcmp(p, "0-1", 3) == 0)) ||
+			(len == 7 && memcmp(p, "1/2-1/2", 7) == 0);
+	}
+};
+
+// Splits a PGN text into games. A game ends where the tag section of the
+// next one starts.
+class PgnReader {
+	const char	*m_pos;
+	const char	*m_end;
+
+public:
+	PgnReader(const char *begin, const char *end) { m_pos = begin; m_end = end; }
+
+	bool next_game(PgnGame& game) {
+		const char *p = m_pos;
+		while (p < m_end && *p != '[' && !at_line_start_move(p)) p = next_line(p);
+		if (p >= m_end) return false;
+		const char *begin = p;
+		while (p < m_end && *p == '[') p = next_line(p);
+		const char *moves = p;
+		while (p < m_end && *p != '[') p = next_line(p);
+		game = PgnGame(begin, moves, p);
+		m_pos = p;
+		return true;
+	}
+
+private:
+	const char *next_line(const char *p) const {
+		const char *q = static_cast<const char*>( memchr(p, '\n', m_end - p) );
+		return (q == NULL) ? m_end : q + 1;
+	}
+
+	bool at_line_start_move(const char *p) const {
+		return ('1' <= *p && *p <= '9');
+	}
+};
+
+class PgnFile {
+	const char	*m_data;
+	size_t		m_size;
+
+public:
+	PgnFile() { m_data = NULL; m_size = 0; }
+	~PgnFile() { close(); }
+
+	bool open(const char *path) {
+		close();
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			::close(fd);
+			return false;
+		}
+		m_size = st.st_size;
+		if (m_size == 0) {
+			::close(fd);
+			return true;
+		}
+		void *map = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (map == MAP_FAILED) {
+			m_size = 0;
+			return false;
+		}
+		madvise(map, m_size, MADV_SEQUENTIAL);
+		m_data = static_cast<const char*>(map);
+		return true;
+	}
+
+	void close() {
+		if (m_data != NULL) munmap(const_cast<char*>(m_data), m_size);
+		m_data = NULL;
+		m_size = 0;
+	}
+
+	const char *begin() const { return m_data; }
+	const char *end() const { return m_data + m_size; }
+	size_t size() const { return m_size; }
+};
+
+// Replays the main line of a game from the initial position. visit(chess,
+// move) sees each move before it is played and may return false to stop.
+// Returns the number of plies played, or -(ply + 1) for the first move the
+// engine rejected.
+template <class Visitor>
+int pgn_replay(PgnGame& game, Chess& chess, Visitor& visit) {
+	char san[16];
+	int ply = 0;
+	chess.setup();
+	game.rewind();
+	while ( game.next_move(san, sizeof san) ) {
+		Move move;
+		if (chess.parse_san(san, move) != Chess::ACCEPTED) return -(ply + 1);
+		if ( !visit(chess, move) ) break;
+		if (chess.enter_move(move) != Chess::ACCEPTED) return -(ply + 1);
+		++ply;
+	}
+	return ply;
+}
+
+// Whether the last non-blank line before the line starting at p is a tag.
+inline bool pgn_follows_tag(const char *p, const char *begin) {
+	while (p > begin) {
+		const char *line = p - 1;
+		while (line > begin && line[-1] != '\n') --line;
+		if (line < p - 1 && *line != '\r') return *line == '[';
+		p = line;
+	}
+	return false;
+}
+
+// First tag line at or after p that follows a line that is not a tag.
+inline const char *pgn_game_start(const char *p, const char *begin, const char *end) {
+	if (p == begin) return p;
+	if (p[-1] != '\n') {
+		p = static_cast<const char*>( memchr(p, '\n', end - p) );
+		if (p == NULL) return end;
+		++p;
+	}
+	bool tag = pgn_follows_tag(p, begin);
+	while (p < end) {
+		if (*p == '[') {
+			if (!tag) return p;
+			tag = true;
+		} else if (*p != '\n' && *p != '\r') {
+			tag = false;
+		}
+		p = static_cast<const char*>( memchr(p, '\n', end - p) );
+		if (p == NULL) return end;
+		++p;
+	}
+	return end;
+}
+
+// Hands the games of a PGN text to a set of workers, one thread each. The
+// text is cut into fixed-size chunks that threads claim in order; a chunk
+// owns the games whose tag section starts inside it, so no thread has to
+// scan the text ahead of the others.
+template <class Worker>
+void pgn_for_each_game(const char *begin, const char *end, vector<Worker>& workers) {
+	static const size_t s_chunk = 1 << 20;
+	size_t chunks = (end - begin + s_chunk - 1) / s_chunk;
+	atomic<size_t> next(0);
+	vector<thread> threads;
+	for (size_t t = 0; t < workers.size(); ++t) {
+		threads.push_back( thread([&, t]() {
+			Worker& worker = workers[t];
+			for (size_t i = next++; i < chunks; i = next++) {
+				const char *first = pgn_game_start(begin + i * s_chunk, begin, end);
+				const char *last = pgn_game_start(begin + min((i + 1) * s_chunk, (size_t) (end - begin)), begin, end);
+				PgnReader reader(first, last);
+				PgnGame game;
+				while ( reader.next_game(game) ) worker(game);
+			}
+		}) );
+	}
+	for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+}
+
+#endif
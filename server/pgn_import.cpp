@@ -0,0 +1,141 @@
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "archive.hpp"
+#include "chess.hpp"
+#include "move_cache.hpp"
+#include "pgn.hpp"
+
+using namespace std;
+
+static const size_t s_move_cache_mb = 64;
+
+struct CollectMoves {
+	vector<Move>	moves;
+	bool operator()(const Chess&, const Move& move) { moves.push_back(move); return true; }
+};
+
+// "2024.03.17" as seconds since the epoch; unknown parts such as "??" count
+// as the first month or day, and an unknown year as 0.
+static uint32_t pgn_date(const PgnGame& game) {
+	string value;
+	struct tm date = tm();
+	if ( !game.tag("Date", value) || sscanf(value.c_str(), "%d", &date.tm_year) != 1 ) return 0;
+	date.tm_mon = date.tm_mday = 1;
+	sscanf(value.c_str(), "%*d.%d.%d", &date.tm_mon, &date.tm_mday);
+	date.tm_year -= 1900;
+	date.tm_mon -= 1;
+	time_t t = timegm(&date);
+	return (t < 0) ? 0 : (uint32_t) t;
+}
+
+class Validator {
+	Chess			m_chess;
+	CollectMoves	m_visit;
+	bool			m_verbose;
+	bool			m_archive;
+	MoveCache		*m_cache;
+
+public:
+	uint64_t				games;
+	uint64_t				plies;
+	uint64_t				rejected;
+	vector<ArchivedGame>	archived;	// the accepted games, if archiving
+
+	// Games to archive are encoded with the legal moves from cache, which
+	// all workers share.
+	Validator(bool verbose = false, bool archive = false, MoveCache *cache = NULL) {
+		m_verbose = verbose;
+		m_archive = archive;
+		m_cache = cache;
+		games = plies = rejected = 0;
+	}
+	Validator(const Validator& other) {
+		m_verbose = other.m_verbose;
+		m_archive = other.m_archive;
+		m_cache = other.m_cache;
+		games = plies = rejected = 0;
+	}
+
+	void operator()(PgnGame& game) {
+		m_visit.moves.clear();
+		int n = pgn_replay(game, m_chess, m_visit);
+		++games;
+		if (n >= 0) {
+			plies += n;
+			if (m_archive) add(game);
+			return;
+		}
+		plies += -n - 1;
+		++rejected;
+		if (m_verbose) {
+			string event;
+			game.tag("Event", event);
+			fprintf(stderr, "rejected at ply %d: %s\n", -n, event.c_str());
+		}
+	}
+
+private:
+	void add(const PgnGame& game) {
+		ArchivedGame a;
+		if ( !a.encode( m_visit.moves.data(), (int) m_visit.moves.size(), m_cache ) ) return;
+		int result = game.result();
+		a.result = (result == PgnGame::UNKNOWN) ? (uint8_t) ARCHIVE_UNKNOWN : (uint8_t) result;
+		a.date = pgn_date(game);
+		game.tag("White", a.white);
+		game.tag("Black", a.black);
+		archived.push_back(a);
+	}
+};
+
+int main(int argc, char *argv[]) {
+	int threads = thread::hardware_concurrency();
+	bool verbose = false;
+	const char *archive_path = NULL;
+	int opt;
+	while ( (opt = getopt(argc, argv, "j:va:")) != -1 ) {
+		if (opt == 'j') threads = atoi(optarg);
+		else if (opt == 'a') archive_path = optarg;
+		else if (opt == 'v') verbose = true;
+		else break;
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-j threads] [-v] [-a games.arc] games.pgn...\n", argv[0]);
+		return 1;
+	}
+	if (threads < 1) threads = 1;
+	ArchiveWriter archive;
+	if ( archive_path != NULL && !archive.open(archive_path) ) {
+		perror(archive_path);
+		return 1;
+	}
+
+	MoveCache cache( (archive_path != NULL) ? s_move_cache_mb : 0 );
+
+	uint64_t games = 0, plies = 0, rejected = 0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = optind; i < argc; ++i) {
+		PgnFile file;
+		if ( !file.open(argv[i]) ) {
+			fprintf(stderr, "%s: cannot open\n", argv[i]);
+			return 1;
+		}
+		vector<Validator> workers( threads, Validator(verbose, archive_path != NULL, &cache) );
+		pgn_for_each_game(file.begin(), file.end(), workers);
+		for (size_t t = 0; t < workers.size(); ++t) {
+			for (size_t g = 0; g < workers[t].archived.size(); ++g) archive.add(workers[t].archived[g]);
+			games += workers[t].games;
+			plies += workers[t].plies;
+			rejected += workers[t].rejected;
+		}
+	}
+	archive.close();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	printf("%llu games, %llu plies, %llu rejected, %.0f games/s\n",
+		(unsigned long long) games, (unsigned long long) plies, (unsigned long long) rejected,
+		seconds > 0 ? games / seconds : 0.0);
+	return rejected == 0 ? 0 : 2;
+}
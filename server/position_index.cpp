@@ -0,0 +1,102 @@
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <chrono>
+#include <vector>
+#include "archive.hpp"
+#include "move_cache.hpp"
+#include "position_index.hpp"
+
+using namespace std;
+
+static const char *s_results[] = { "0-1", "1/2-1/2", "1-0", "*" };
+static const size_t s_move_cache_mb = 64;
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Brings the index up to date with the archive.
+static int update(const Archive& archive, const char *path) {
+	MoveCache cache(s_move_cache_mb);
+	PositionIndexWriter writer(&cache);
+	if ( !writer.open(path) ) {
+		perror(path);
+		return 1;
+	}
+	uint64_t first = writer.end_game();
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	if ( !writer.add(archive) || !writer.commit() ) {
+		fprintf(stderr, "%s: cannot update\n", path);
+		return 1;
+	}
+	PositionIndex index;
+	index.open(path);
+	uint64_t keys = 0, hits = 0;
+	for (size_t s = 0; s < index.segments().size(); ++s) {
+		keys += index.segments()[s]->keys;
+		hits += index.segments()[s]->hits;
+	}
+	printf("indexed games %llu to %llu in %.2f s; %zu segments, %llu keys, %llu positions, %zu bytes\n",
+		(unsigned long long) first, (unsigned long long) index.end_game(), seconds_since(start),
+		index.segments().size(), (unsigned long long) keys, (unsigned long long) hits, index.size());
+	return 0;
+}
+
+// The games that reached fen, with the ply each reached it at.
+static int search(const Archive& archive, const char *path, const char *fen, size_t max) {
+	PositionIndex index;
+	if ( !index.open(path) ) {
+		fprintf(stderr, "%s: not an index\n", path);
+		return 1;
+	}
+	Chess chess;
+	if ( !chess.setup(fen) ) {
+		fprintf(stderr, "%s: bad position\n", fen);
+		return 1;
+	}
+	vector<IndexHit> hits;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	index.lookup(chess.hash(), hits, max);
+	double elapsed = seconds_since(start);
+	for (size_t i = 0; i < hits.size(); ++i) {
+		const ArchiveBlockHeader *b = archive.find(hits[i].game);
+		if (b == NULL) {
+			printf("%llu\t%u\n", (unsigned long long) hits[i].game, hits[i].ply);
+			continue;
+		}
+		ArchiveBlock block(b);
+		uint32_t g = (uint32_t) (hits[i].game - block.first_game());
+		time_t date = block.dates()[g];
+		char day[16];
+		strftime(day, sizeof day, "%Y.%m.%d", gmtime(&date));
+		printf( "%llu\t%u\t%s\t%s\t%s\t%s\n", (unsigned long long) hits[i].game, hits[i].ply,
+			block.white(g).c_str(), block.black(g).c_str(), day,
+			s_results[ min<uint8_t>(block.results()[g], ARCHIVE_UNKNOWN) ] );
+	}
+	fprintf(stderr, "%zu games in %.3f ms\n", hits.size(), elapsed * 1e3);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *fen = NULL;
+	size_t max = 100;
+	int opt;
+	while ( (opt = getopt(argc, argv, "f:n:")) != -1 ) {
+		if (opt == 'f') fen = optarg;
+		else if (opt == 'n') max = atoi(optarg);
+		else break;
+	}
+	if (optind + 2 > argc) {
+		fprintf(stderr, "usage: %s [-f fen [-n max]] games.arc games.idx\n", argv[0]);
+		return 1;
+	}
+	Archive archive;
+	if ( !archive.open(argv[optind]) ) {
+		fprintf(stderr, "%s: not an archive\n", argv[optind]);
+		return 1;
+	}
+	if (fen != NULL) return search(archive, argv[optind + 1], fen, max);
+	return update(archive, argv[optind + 1]);
+}
@@ -0,0 +1,562 @@
+#ifndef POSITION_INDEX_HPP
+#define POSITION_INDEX_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include "archive.hpp"
+#include "chess.hpp"
+#include "move_cache.hpp"
+
+using namespace std;
+
+// Where a position occurred: a game id of the archive and the number of
+// plies played before it.
+struct IndexHit {
+	uint64_t	game;
+	uint32_t	ply;
+};
+
+// An index is a manifest, s_index_magic followed by a uint64_t number for
+// each segment, oldest first, and one file per segment named after the
+// manifest with ".<number>" appended. A segment covers the archive games
+// [first_game, end_game) and holds, for
+// every Chess::hash() reached in them, the hits sorted by game and ply.
+// Each key's hits are varints: the game as a delta from the previous hit's
+// game, then the ply, or its delta when the game did not change.
+struct IndexSegmentHeader {
+	char		magic[4];
+	uint32_t	fence_stride;	// keys per fence
+	uint64_t	first_game;
+	uint64_t	end_game;
+	uint64_t	keys;
+	uint64_t	hits;
+	uint64_t	size;			// bytes after the header
+	// Followed by uint64_t fences[(keys + fence_stride - 1) / fence_stride],
+	// the first key of each run of fence_stride entries, then keys + 1
+	// IndexEntry, the last one a sentinel whose offset ends the hit bytes,
+	// then the hit bytes.
+};
+
+struct IndexEntry {
+	uint64_t	key;
+	uint64_t	offset;		// of the key's hits in the hit bytes
+};
+
+static const char s_index_magic[8] = { 'C', 'H', 'I', 'D', 'X', '2', '\0', '\0' };
+static const char s_index_segment_magic[4] = { 'S', 'E', 'G', '1' };
+
+inline void index_put_varint(vector<uint8_t>& out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back( (uint8_t) (value | 0x80) );
+		value >>= 7;
+	}
+	out.push_back( (uint8_t) value );
+}
+
+inline uint64_t index_get_varint(const uint8_t *&p) {
+	uint64_t value = 0;
+	for (int shift = 0; ; shift += 7) {
+		uint8_t b = *p++;
+		value |= (uint64_t) (b & 0x7f) << shift;
+		if (b < 0x80) return value;
+	}
+}
+
+inline string index_segment_path(const string& path, uint64_t number) {
+	return path + "." + to_string(number);
+}
+
+inline bool index_read_manifest(const string& path, vector<uint64_t>& numbers) {
+	numbers.clear();
+	FILE *in = fopen(path.c_str(), "rb");
+	if (in == NULL) return false;
+	char magic[sizeof s_index_magic];
+	bool ok = fread(magic, sizeof magic, 1, in) == 1 && memcmp(magic, s_index_magic, sizeof magic) == 0;
+	uint64_t number;
+	while ( ok && fread(&number, sizeof number, 1, in) == 1 ) numbers.push_back(number);
+	fclose(in);
+	return ok;
+}
+
+// Replaces the manifest at once, so a reader sees the old list or the new.
+inline bool index_write_manifest(const string& path, const vector<uint64_t>& numbers) {
+	string tmp = path + ".tmp";
+	FILE *out = fopen(tmp.c_str(), "wb");
+	if (out == NULL) return false;
+	bool ok = fwrite(s_index_magic, sizeof s_index_magic, 1, out) == 1 &&
+		fwrite(numbers.data(), sizeof(uint64_t), numbers.size(), out) == numbers.size();
+	return fclose(out) == 0 && ok && rename( tmp.c_str(), path.c_str() ) == 0;
+}
+
+// A read-only view of one segment in a mapped index.
+class IndexSegment {
+	const IndexSegmentHeader	*m_header;
+	const uint64_t				*m_fences;
+	const IndexEntry			*m_entries;
+	const uint8_t				*m_hits;
+
+public:
+	IndexSegment(const IndexSegmentHeader *header) {
+		m_header = header;
+		m_fences = reinterpret_cast<const uint64_t*>(header + 1);
+		m_entries = reinterpret_cast<const IndexEntry*>(m_fences + fences());
+		m_hits = reinterpret_cast<const uint8_t*>(m_entries + header->keys + 1);
+	}
+
+	const IndexSegmentHeader *header() const { return m_header; }
+	uint64_t keys() const { return m_header->keys; }
+	const IndexEntry& entry(uint64_t i) const { return m_entries[i]; }
+
+	// The entry of key, or keys() if it is not here. The fences are small
+	// enough to stay cached, so a cold lookup touches one page of entries.
+	uint64_t find(uint64_t key) const {
+		const uint64_t *fence = upper_bound(m_fences, m_fences + fences(), key);
+		if (fence == m_fences) return keys();
+		uint64_t begin = (uint64_t) (fence - m_fences - 1) * m_header->fence_stride;
+		uint64_t end = min<uint64_t>(begin + m_header->fence_stride, keys());
+		const IndexEntry *e = lower_bound( m_entries + begin, m_entries + end, key,
+			[](const IndexEntry& entry, uint64_t k) { return entry.key < k; } );
+		return (e != m_entries + end && e->key == key) ? (uint64_t) (e - m_entries) : keys();
+	}
+
+	// Appends the hits of entry i, stopping once hits holds max of them.
+	void hits(uint64_t i, vector<IndexHit>& hits, size_t max) const {
+		const uint8_t *p = m_hits + m_entries[i].offset;
+		const uint8_t *end = m_hits + m_entries[i + 1].offset;
+		IndexHit hit = { 0, 0 };
+		while (p < end && hits.size() < max) {
+			uint64_t delta = index_get_varint(p);
+			uint64_t ply = index_get_varint(p);
+			hit.ply = (uint32_t) (delta == 0 ? hit.ply + ply : ply);
+			hit.game += delta;
+			hits.push_back(hit);
+		}
+	}
+
+private:
+	uint64_t fences() const { return (m_header->keys + m_header->fence_stride - 1) / m_header->fence_stride; }
+};
+
+// The mapped segments of an index. Opening it again picks up segments
+// written since.
+class PositionIndex {
+	struct Mapping {
+		const char	*data;
+		size_t		size;
+	};
+	vector<Mapping>						m_files;
+	vector<uint64_t>					m_numbers;
+	vector<const IndexSegmentHeader*>	m_segments;
+	size_t								m_size;
+
+public:
+	PositionIndex() { m_size = 0; }
+	~PositionIndex() { close(); }
+
+	// A writer may replace segments between our reading the manifest and
+	// mapping them, so a segment that has gone sends us back to the
+	// manifest, which by then names what replaced it.
+	bool open(const char *path) {
+		for (int attempt = 0; attempt < 3; ++attempt) {
+			close();
+			if ( !index_read_manifest(path, m_numbers) ) return false;
+			m_size = sizeof s_index_magic + m_numbers.size() * sizeof(uint64_t);
+			size_t s = 0;
+			while ( s < m_numbers.size() && map( index_segment_path(path, m_numbers[s]) ) ) ++s;
+			if ( s == m_numbers.size() ) return true;
+		}
+		close();
+		return false;
+	}
+
+	void close() {
+		for (size_t i = 0; i < m_files.size(); ++i) munmap(const_cast<char*>(m_files[i].data), m_files[i].size);
+		m_files.clear();
+		m_numbers.clear();
+		m_segments.clear();
+		m_size = 0;
+	}
+
+	// Up to max places where key occurred, oldest game first.
+	size_t lookup(uint64_t key, vector<IndexHit>& hits, size_t max = SIZE_MAX) const {
+		hits.clear();
+		for (size_t s = 0; s < m_segments.size() && hits.size() < max; ++s) {
+			IndexSegment segment(m_segments[s]);
+			uint64_t i = segment.find(key);
+			if ( i == segment.keys() ) continue;
+			size_t first = hits.size();
+			segment.hits(i, hits, max);
+			for (size_t h = first; h < hits.size(); ++h) hits[h].game += m_segments[s]->first_game;
+		}
+		return hits.size();
+	}
+
+	const vector<const IndexSegmentHeader*>& segments() const { return m_segments; }
+	// The file number of each segment, as the manifest lists them.
+	const vector<uint64_t>& numbers() const { return m_numbers; }
+	// The first archive game the index does not cover yet.
+	uint64_t end_game() const { return m_segments.empty() ? 0 : m_segments.back()->end_game; }
+	// Bytes of the manifest and the segment files together.
+	size_t size() const { return m_size; }
+
+private:
+	bool map(const string& path) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(IndexSegmentHeader)) {
+			::close(fd);
+			return false;
+		}
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (data == MAP_FAILED) return false;
+		Mapping file = { static_cast<const char*>(data), (size_t) st.st_size };
+		m_files.push_back(file);
+		const IndexSegmentHeader *segment = reinterpret_cast<const IndexSegmentHeader*>(file.data);
+		if ( memcmp(segment->magic, s_index_segment_magic, sizeof segment->magic) != 0 ||
+				segment->size > file.size - sizeof(IndexSegmentHeader) ) return false;
+		m_segments.push_back(segment);
+		m_size += file.size;
+		return true;
+	}
+};
+
+// Streams one segment into a file at offset. The number of keys and of hit
+// bytes come from a first pass over the same keys, so entries and hits go
+// straight to their places and no segment has to fit in memory.
+class IndexSegmentWriter {
+	static const size_t s_buffer = 1 << 20;
+	int					m_fd;
+	off_t				m_offset;
+	IndexSegmentHeader	m_header;
+	off_t				m_entries;	// file offset of the next entry
+	off_t				m_hits;		// of the next hit byte
+	uint64_t			m_hit_bytes;
+	vector<uint64_t>	m_fences;
+	vector<uint8_t>		m_entry_buffer;
+	vector<uint8_t>		m_hit_buffer;
+	bool				m_ok;
+
+public:
+	static const uint32_t s_fence_stride = 256;
+
+	IndexSegmentWriter(int fd, off_t offset, uint64_t first_game, uint64_t end_game, uint64_t keys, uint64_t hit_bytes) {
+		m_fd = fd;
+		m_offset = offset;
+		memset(&m_header, 0, sizeof m_header);
+		memcpy(m_header.magic, s_index_segment_magic, sizeof m_header.magic);
+		m_header.fence_stride = s_fence_stride;
+		m_header.first_game = first_game;
+		m_header.end_game = end_game;
+		m_header.size = size(keys, hit_bytes) - sizeof m_header;
+		m_entries = offset + sizeof m_header + fences(keys) * sizeof(uint64_t);
+		m_hits = m_entries + (keys + 1) * sizeof(IndexEntry);
+		m_hit_bytes = 0;
+		m_ok = true;
+	}
+
+	// Bytes on disk, header included.
+	static uint64_t size(uint64_t keys, uint64_t hit_bytes) {
+		return sizeof(IndexSegmentHeader) + fences(keys) * sizeof(uint64_t) + (keys + 1) * sizeof(IndexEntry) +
+			(hit_bytes + 7) / 8 * 8;
+	}
+
+	// Appends the varints of hits, sorted by game and ply, to out.
+	static void encode(uint64_t first_game, const vector<IndexHit>& hits, vector<uint8_t>& out) {
+		IndexHit last = { first_game, 0 };
+		for (size_t i = 0; i < hits.size(); ++i) {
+			index_put_varint(out, hits[i].game - last.game);
+			index_put_varint(out, (i == 0 || hits[i].game != last.game) ? hits[i].ply : hits[i].ply - last.ply);
+			last = hits[i];
+		}
+	}
+
+	// Keys come in ascending order, hits with absolute game ids.
+	void add(uint64_t key, const vector<IndexHit>& hits) {
+		if (m_header.keys % s_fence_stride == 0) m_fences.push_back(key);
+		IndexEntry entry = { key, m_hit_bytes };
+		put_entry(entry);
+		size_t before = m_hit_buffer.size();
+		encode(m_header.first_game, hits, m_hit_buffer);
+		m_hit_bytes += m_hit_buffer.size() - before;
+		++m_header.keys;
+		m_header.hits += hits.size();
+		if (m_hit_buffer.size() >= s_buffer) flush(m_hit_buffer, m_hits);
+	}
+
+	bool finish() {
+		IndexEntry sentinel = { UINT64_MAX, m_hit_bytes };
+		put_entry(sentinel);
+		m_hit_buffer.resize( m_hit_buffer.size() + (8 - m_hit_bytes % 8) % 8, 0 );
+		flush(m_entry_buffer, m_entries);
+		flush(m_hit_buffer, m_hits);
+		write(m_fences.data(), m_fences.size() * sizeof(uint64_t), m_offset + sizeof m_header);
+		write(&m_header, sizeof m_header, m_offset);
+		return m_ok && size(m_header.keys, m_hit_bytes) == sizeof m_header + m_header.size;
+	}
+
+private:
+	static uint64_t fences(uint64_t keys) { return (keys + s_fence_stride - 1) / s_fence_stride; }
+
+	void put_entry(const IndexEntry& entry) {
+		const uint8_t *p = reinterpret_cast<const uint8_t*>(&entry);
+		m_entry_buffer.insert(m_entry_buffer.end(), p, p + sizeof entry);
+		if (m_entry_buffer.size() >= s_buffer) flush(m_entry_buffer, m_entries);
+	}
+
+	void flush(vector<uint8_t>& buffer, off_t& offset) {
+		write(buffer.data(), buffer.size(), offset);
+		offset += buffer.size();
+		buffer.clear();
+	}
+
+	void write(const void *data, size_t size, off_t offset) {
+		const char *p = static_cast<const char*>(data);
+		while (m_ok && size > 0) {
+			ssize_t n = pwrite(m_fd, p, size, offset);
+			if (n <= 0) m_ok = false;
+			else {
+				p += n;
+				size -= n;
+				offset += n;
+			}
+		}
+	}
+};
+
+// Adds archive games to an index. Games collect in memory until commit()
+// writes them as a new segment; while the last segment is at least half
+// the size of the one before it, the two are merged, so an index of n hits
+// keeps O(log n) segments and each hit is rewritten O(log n) times. Merges
+// write only the segments they merge: the rest stay in their own files.
+class PositionIndexWriter {
+	struct Posting {
+		uint64_t	key;
+		uint64_t	game;
+		uint32_t	ply;
+		bool operator<(const Posting& p) const {
+			if (key != p.key) return key < p.key;
+			if (game != p.game) return game < p.game;
+			return ply < p.ply;
+		}
+	};
+	string			m_path;
+	vector<Posting>	m_postings;
+	uint64_t		m_first_game;
+	uint64_t		m_end_game;
+	MoveCache		*m_cache;
+
+public:
+	static const size_t s_batch_postings = 1 << 24;
+
+	// The games added since the last take(), out of the writer, so that
+	// write() can run on another thread while add() carries on.
+	struct Batch {
+		vector<Posting>	postings;
+		uint64_t		first_game;
+		uint64_t		end_game;
+		bool empty() const { return postings.empty(); }
+	};
+
+	// Games are replayed with the legal moves from cache, if given.
+	PositionIndexWriter(MoveCache *cache = NULL) { m_first_game = m_end_game = 0; m_cache = cache; }
+
+	// Creates the index if needed.
+	bool open(const char *path) {
+		m_path = path;
+		m_postings.clear();
+		PositionIndex index;
+		if ( index.open(path) ) {
+			m_first_game = m_end_game = index.end_game();
+			return true;
+		}
+		m_first_game = m_end_game = 0;
+		return index_write_manifest( m_path, vector<uint64_t>() );
+	}
+
+	// The id the next game must have at least; games come in archive order.
+	uint64_t end_game() const { return m_end_game; }
+
+	// Adds the positions of a game given as ArchivedGame::moves.
+	bool add(uint64_t game, const uint8_t *indices, int n) {
+		if (game < m_end_game) return false;
+		if ( m_postings.empty() ) m_first_game = game;
+		Chess chess;
+		chess.setup();
+		LegalMoves legal;
+		for (int ply = 0; ; ++ply) {
+			Posting posting = { chess.hash(), game, (uint32_t) ply };
+			m_postings.push_back(posting);
+			if (ply == n) break;
+			if (m_cache != NULL) m_cache->get(chess, legal);
+			else legal.count = chess.legal_moves(legal.moves);
+			if (indices[ply] >= legal.count) return false;
+			chess.enter_move(legal.moves[ indices[ply] ]);
+		}
+		m_end_game = game + 1;
+		return true;
+	}
+
+	// Indexes the games of archive the index does not cover yet, committing
+	// every s_batch_postings positions or so.
+	bool add(const Archive& archive) {
+		for (const ArchiveBlockHeader *b = archive.first(); b != NULL; b = archive.next(b)) {
+			ArchiveBlock block(b);
+			if (block.first_game() + block.games() <= m_end_game) continue;
+			ArchiveMoveReader reader = block.moves();
+			vector<uint8_t> indices;
+			for (uint32_t i = 0; i < block.games(); ++i) {
+				indices.resize( block.ply_counts()[i] );
+				for (size_t p = 0; p < indices.size(); ++p) indices[p] = reader.next();
+				uint64_t game = block.first_game() + i;
+				if ( game >= m_end_game && !add( game, indices.data(), (int) indices.size() ) ) return false;
+			}
+			if (m_postings.size() >= s_batch_postings && !commit()) return false;
+		}
+		return true;
+	}
+
+	size_t pending() const { return m_postings.size(); }
+
+	// Writes the games added since the last commit as a new segment.
+	bool commit() {
+		Batch batch;
+		take(batch);
+		if ( write(batch) ) return true;
+		put_back(batch);
+		return false;
+	}
+
+	void take(Batch& batch) {
+		batch.postings.clear();
+		batch.postings.swap(m_postings);
+		batch.first_game = m_first_game;
+		batch.end_game = m_end_game;
+	}
+
+	// Returns a batch write() failed on, to go out with the next one.
+	void put_back(Batch& batch) {
+		if ( batch.empty() ) return;
+		batch.postings.insert( batch.postings.end(), m_postings.begin(), m_postings.end() );
+		m_postings.swap(batch.postings);
+		m_first_game = batch.first_game;
+		batch.postings.clear();
+	}
+
+	// Writes batch to a segment file and adds it to the manifest, then
+	// merges the segments that have become too small. It reads nothing of
+	// the writer but its path, so it may run on another thread than add().
+	// A failed merge is tried again by the next write().
+	bool write(Batch& batch) const {
+		if ( batch.empty() ) return true;
+		sort( batch.postings.begin(), batch.postings.end() );
+		vector<uint64_t> numbers;
+		if ( !index_read_manifest(m_path, numbers) ) return false;
+		uint64_t number = numbers.empty() ? 0 : numbers.back() + 1;
+		const vector<Posting>& pending = batch.postings;
+		function<void(Visit)> source = [&pending](Visit visit) { postings(pending, visit); };
+		if ( !write_segment(number, batch.first_game, batch.end_game, source) ) return false;
+		numbers.push_back(number);
+		if ( !index_write_manifest(m_path, numbers) ) return false;
+		compact();
+		return true;
+	}
+
+private:
+	typedef function<void(uint64_t, const vector<IndexHit>&)> Visit;
+
+	// Visits sorted postings key by key.
+	static void postings(const vector<Posting>& sorted, Visit visit) {
+		vector<IndexHit> hits;
+		for (size_t i = 0; i < sorted.size(); ++i) {
+			IndexHit hit = { sorted[i].game, sorted[i].ply };
+			hits.push_back(hit);
+			if (i + 1 == sorted.size() || sorted[i + 1].key != sorted[i].key) {
+				visit(sorted[i].key, hits);
+				hits.clear();
+			}
+		}
+	}
+
+	// Visits the keys of segments of consecutive game ranges in order, with
+	// the hits of all of them.
+	static void merged(vector<IndexSegment>& parts, Visit visit) {
+		vector<uint64_t> next( parts.size(), 0 );
+		vector<IndexHit> hits;
+		for (;;) {
+			uint64_t key = UINT64_MAX;
+			bool any = false;
+			for (size_t s = 0; s < parts.size(); ++s) {
+				if ( next[s] == parts[s].keys() ) continue;
+				if (!any || parts[s].entry(next[s]).key < key) key = parts[s].entry(next[s]).key;
+				any = true;
+			}
+			if (!any) return;
+			hits.clear();
+			for (size_t s = 0; s < parts.size(); ++s) {
+				if ( next[s] == parts[s].keys() || parts[s].entry(next[s]).key != key ) continue;
+				size_t first = hits.size();
+				parts[s].hits(next[s]++, hits, SIZE_MAX);
+				for (size_t h = first; h < hits.size(); ++h) hits[h].game += parts[s].header()->first_game;
+			}
+			visit(key, hits);
+		}
+	}
+
+	// Writes what source visits, twice over since the first pass only
+	// counts the keys and hit bytes, as the segment file number.
+	bool write_segment(uint64_t number, uint64_t first_game, uint64_t end_game, function<void(Visit)> source) const {
+		uint64_t keys = 0, bytes = 0;
+		vector<uint8_t> scratch;
+		source( [&](uint64_t, const vector<IndexHit>& hits) {
+			scratch.clear();
+			IndexSegmentWriter::encode(first_game, hits, scratch);
+			++keys;
+			bytes += scratch.size();
+		} );
+		int fd = ::open(index_segment_path(m_path, number).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) return false;
+		IndexSegmentWriter writer(fd, 0, first_game, end_game, keys, bytes);
+		source( [&writer](uint64_t key, const vector<IndexHit>& hits) { writer.add(key, hits); } );
+		bool ok = writer.finish();
+		return ::close(fd) == 0 && ok;
+	}
+
+	// Merges the last segments into a new file and swaps it for them in the
+	// manifest. Readers that still map the old files keep them until they
+	// let go, since they are only unlinked.
+	bool compact() const {
+		PositionIndex index;
+		if ( !index.open( m_path.c_str() ) || index.segments().empty() ) return false;
+		const vector<const IndexSegmentHeader*>& segments = index.segments();
+		size_t keep = segments.size() - 1;
+		uint64_t size = segments.back()->size;
+		while (keep > 0 && segments[keep - 1]->size <= 2 * size) size += segments[--keep]->size;
+		if (keep + 1 == segments.size()) return true;
+
+		vector<IndexSegment> parts;
+		for (size_t s = keep; s < segments.size(); ++s) parts.push_back( IndexSegment(segments[s]) );
+		vector<uint64_t> numbers = index.numbers();
+		uint64_t number = numbers.back() + 1;
+		function<void(Visit)> source = [&parts](Visit visit) { merged(parts, visit); };
+		if ( !write_segment(number, segments[keep]->first_game, segments.back()->end_game, source) ) return false;
+		vector<uint64_t> old( numbers.begin() + keep, numbers.end() );
+		numbers.resize(keep);
+		numbers.push_back(number);
+		if ( !index_write_manifest(m_path, numbers) ) return false;
+		for (size_t i = 0; i < old.size(); ++i) unlink( index_segment_path(m_path, old[i]).c_str() );
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+// The port clients connect to, on the server or on the proxy in front of it.
+static const int s_default_port = 3000;
+
+// Messages between the server and its clients are NUL-terminated strings.
+// A message starting with a prefix carries its arguments after it.
+static const char s_msg_setup[] = "setup";
+static const char s_msg_your_turn[] = "your turn";
+static const char s_msg_not_your_turn[] = "not your turn";
+static const char s_msg_invalid_move[] = "invalid move";
+static const char s_msg_invalid_join[] = "invalid join";
+static const char s_msg_book[] = "book";
+static const char s_msg_games[] = "games";
+static const char s_prefix_fen[] = "fen ";
+static const char s_prefix_legal[] = "legal";
+static const char s_prefix_game_over[] = "game over";
+static const char s_prefix_replay[] = "replay ";
+static const char s_prefix_ping[] = "ping ";
+static const char s_prefix_pong[] = "pong ";
+static const char s_prefix_clock[] = "clock ";
+static const char s_prefix_join[] = "join ";
+
+inline bool has_prefix(const char *message, const char *prefix) {
+	return strncmp( message, prefix, strlen(prefix) ) == 0;
+}
+
+// Reassembles messages from a byte stream that may split them or carry
+// several at once. Bytes go in with feed(); next() hands out complete
+// messages in order.
+class FrameDecoder {
+	std::string	m_buffer;
+	size_t		m_pos;
+
+public:
+	enum { MAX_FRAME = 4096 };
+
+	FrameDecoder() { m_pos = 0; }
+
+	void feed(const char *data, size_t size) {
+		if (m_pos > 0) {
+			m_buffer.erase(0, m_pos);
+			m_pos = 0;
+		}
+		m_buffer.append(data, size);
+	}
+
+	bool next(std::string& frame) {
+		size_t end = m_buffer.find('\0', m_pos);
+		if (end == std::string::npos) return false;
+		frame.assign(m_buffer, m_pos, end - m_pos);
+		m_pos = end + 1;
+		return true;
+	}
+
+	// Whether next() has a message to hand out.
+	bool ready() const { return m_buffer.find('\0', m_pos) != std::string::npos; }
+
+	// What has been fed but not returned by next() yet.
+	std::string unread() const { return m_buffer.substr(m_pos); }
+
+	// Whether the unfinished message is longer than any valid one.
+	bool overflow() const { return m_buffer.size() - m_pos > MAX_FRAME; }
+};
+
+#endif
@@ -0,0 +1,408 @@
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "hash_ring.hpp"
+#include "protocol.hpp"
+
+using namespace std;
+
+static volatile sig_atomic_t s_reload = 0;
+static volatile sig_atomic_t s_dump_stats = 0;
+
+static void request_reload(int) { s_reload = 1; }
+static void request_stats(int) { s_dump_stats = 1; }
+
+// Relays clients to backend servers. Players are paired here, in the order
+// they connect, and each pair gets a game id; the game goes to the backend
+// the id hashes to on a HashRing, which opens both of its connections
+// with "join <game> <colour>". Backends run with -r so that they pair by
+// those messages. The list of backends is reread on SIGHUP; games already
+// relayed stay where they are, and new games spread over the new ring.
+// Every socket is non-blocking: backend connections complete on EPOLLOUT,
+// and what a socket does not take at once waits in its link's output.
+class Proxy {
+	static const int s_max_events = 64;
+	static const int s_listen = 10;
+	static const size_t s_max_pending = 4096;
+	static const size_t s_max_output = 1 << 16;
+	struct Link {
+		bool		open;
+		bool		connecting;	// a backend connection not made yet
+		int			peer;		// the other end of the relay, or -1 until the game starts
+		uint64_t	game;		// the game being routed, or 0
+		string		pending;	// what a player sent before the game started
+		string		output;		// what the socket has not taken yet
+	};
+	// A game whose two backend connections are being made to candidate
+	// next - 1, after the candidates before it failed.
+	struct Route {
+		vector<sockaddr_in>	addresses;
+		vector<int>			order;		// ring nodes of the addresses
+		size_t				next;
+		int					players[2];	// black, white
+		int					backends[2];
+		int					connected;
+	};
+	const char			*m_backends_path;
+	int					m_port;
+	int					m_epoll;
+	HashRing			m_ring;
+	vector<sockaddr_in>	m_addresses;	// of each ring node, resolved as the list is read
+	vector<uint64_t>	m_routed;	// games sent to each backend since the list was read
+	vector<Link>		m_links;	// by fd
+	unordered_map<uint64_t, Route>	m_routes;
+	int					m_waiting;
+	uint64_t			m_next_game;
+
+public:
+	Proxy(const char *backends_path, int port = s_default_port) {
+		m_backends_path = backends_path;
+		m_port = port;
+		m_epoll = -1;
+		m_waiting = -1;
+		// Ids from an earlier run may still wait for their second join.
+		m_next_game = (uint64_t) time(NULL) << 20;
+	}
+
+	// "host:port" per line; blank lines and lines starting with # are skipped.
+	// Names are resolved here, so routing a game never waits on DNS; one
+	// that does not resolve stays on the ring and fails to connect.
+	bool load_backends() {
+		FILE *in = fopen(m_backends_path, "r");
+		if (in == NULL) return false;
+		vector<string> backends;
+		char line[256];
+		while (fgets(line, sizeof line, in) != NULL) {
+			line[strcspn(line, " \t\r\n")] = '\0';
+			if (line[0] != '\0' && line[0] != '#') backends.push_back(line);
+		}
+		fclose(in);
+		if ( backends.empty() ) return false;
+		m_ring.set(backends);
+		m_routed.assign(backends.size(), 0);
+		m_addresses.resize( backends.size() );
+		for (size_t i = 0; i < backends.size(); ++i) resolve(backends[i], m_addresses[i]);
+		return true;
+	}
+
+	void run() {
+		int fd = create_socket();
+		m_epoll = epoll_create1(0);
+		watch(fd);
+		signal(SIGPIPE, SIG_IGN);
+		signal(SIGHUP, request_reload);
+		signal(SIGUSR1, request_stats);
+		for (;;) {
+			if (s_reload) {
+				if ( !load_backends() ) fprintf(stderr, "%s: no backends, keeping the old list\n", m_backends_path);
+				s_reload = 0;
+			}
+			if (s_dump_stats) {
+				dump_stats();
+				s_dump_stats = 0;
+			}
+			struct epoll_event events[s_max_events];
+			int nevents = epoll_wait(m_epoll, events, s_max_events, -1);
+			for (int n = 0; n < nevents; n++) {
+				int conn = events[n].data.fd;
+				if (conn == fd) {
+					conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK);
+					if (conn >= 0) on_connect(conn);
+					continue;
+				}
+				// An fd dropped earlier in this batch, or since reused.
+				if ( (size_t) conn >= m_links.size() || !m_links[conn].open ) continue;
+				if (m_links[conn].connecting) {
+					on_connected(conn);
+					continue;
+				}
+				if (events[n].events & EPOLLOUT) on_writable(conn);
+				if ( m_links[conn].open && (events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ) on_read(conn);
+			}
+		}
+	}
+
+private:
+	void on_connect(int fd) {
+		link(fd);
+		watch(fd);
+		if (m_waiting < 0) {
+			m_waiting = fd;
+			return;
+		}
+		int black = m_waiting;
+		m_waiting = -1;
+		route(black, fd);
+	}
+
+	void route(int black, int white) {
+		uint64_t game = m_next_game++;
+		Route& route = m_routes[game];
+		m_ring.candidates(game, route.order);
+		for (size_t i = 0; i < route.order.size(); ++i) route.addresses.push_back( m_addresses[ route.order[i] ] );
+		route.next = 0;
+		route.players[0] = black;
+		route.players[1] = white;
+		m_links[black].game = m_links[white].game = game;
+		try_next(game);
+	}
+
+	// Starts both of game's connections to its next candidate backend, or
+	// gives the game up once none is left.
+	void try_next(uint64_t game) {
+		Route& route = m_routes[game];
+		while ( route.next < route.addresses.size() ) {
+			const sockaddr_in& address = route.addresses[route.next++];
+			int to_black = connect_backend(address);
+			if (to_black < 0) continue;
+			int to_white = connect_backend(address);
+			if (to_white < 0) {
+				close(to_black);
+				continue;
+			}
+			route.backends[0] = to_black;
+			route.backends[1] = to_white;
+			route.connected = 0;
+			for (int c = 0; c < 2; ++c) {
+				link(route.backends[c]);
+				m_links[ route.backends[c] ].connecting = true;
+				m_links[ route.backends[c] ].game = game;
+				watch(route.backends[c], EPOLLOUT);
+			}
+			return;
+		}
+		fprintf(stderr, "game %llu: no backend\n", (unsigned long long) game);
+		int black = route.players[0], white = route.players[1];
+		m_routes.erase(game);
+		drop(black);
+		drop(white);
+	}
+
+	// A backend connection has been made or has failed. A failure moves
+	// the game to its next candidate.
+	void on_connected(int fd) {
+		int error = 0;
+		socklen_t length = sizeof error;
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+		struct sockaddr_in peer;
+		socklen_t peer_length = sizeof peer;
+		// A stale event for an fd reused before the batch was done.
+		if ( error == 0 && getpeername(fd, (struct sockaddr*) &peer, &peer_length) < 0 ) return;
+		uint64_t game = m_links[fd].game;
+		Route& route = m_routes[game];
+		if (error != 0) {
+			unlink(route.backends[0]);
+			unlink(route.backends[1]);
+			try_next(game);
+			return;
+		}
+		m_links[fd].connecting = false;
+		interest(fd, EPOLLIN);
+		if (++route.connected < 2) return;
+		string join = s_prefix_join + to_string(game);
+		int node = route.order[route.next - 1];
+		if ( (size_t) node < m_routed.size() ) ++m_routed[node];
+		int players[2] = { route.players[0], route.players[1] };
+		int backends[2] = { route.backends[0], route.backends[1] };
+		m_routes.erase(game);
+		for (int c = 0; c < 2; ++c) {
+			m_links[ players[c] ].game = m_links[ backends[c] ].game = 0;
+			m_links[ players[c] ].peer = backends[c];
+			m_links[ backends[c] ].peer = players[c];
+		}
+		send(backends[0], join + " black");
+		send(backends[1], join + " white");
+		for (int c = 0; c < 2 && m_links[ players[c] ].open; ++c) {
+			string pending;
+			pending.swap(m_links[ players[c] ].pending);
+			send( backends[c], pending.data(), pending.size() );
+		}
+	}
+
+	void on_read(int fd) {
+		char data[4096];
+		ssize_t size = read(fd, data, sizeof data);
+		if (size < 0 && (errno == EAGAIN || errno == EINTR)) return;
+		if (size <= 0) {
+			drop(fd);
+			return;
+		}
+		Link& link = m_links[fd];
+		if (link.peer >= 0) {
+			send(link.peer, data, size);
+		} else if (link.pending.size() + size <= s_max_pending) {
+			link.pending.append(data, size);
+		} else {
+			drop(fd);
+		}
+	}
+
+	void on_writable(int fd) {
+		Link& link = m_links[fd];
+		ssize_t n = write( fd, link.output.data(), link.output.size() );
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EINTR) drop(fd);
+			return;
+		}
+		link.output.erase(0, n);
+		if ( link.output.empty() ) interest(fd, EPOLLIN);
+	}
+
+	// Closes fd and the other end of its relay, or, before its game has
+	// started, the game's other connections.
+	void drop(int fd) {
+		if (m_waiting == fd) m_waiting = -1;
+		int peer = m_links[fd].peer;
+		uint64_t game = m_links[fd].game;
+		unlink(fd);
+		if (peer >= 0) unlink(peer);
+		unordered_map<uint64_t, Route>::iterator route = m_routes.find(game);
+		if (game == 0 || route == m_routes.end() ) return;
+		Route dropped = route->second;
+		m_routes.erase(route);
+		for (int c = 0; c < 2; ++c) {
+			unlink(dropped.players[c]);
+			if (dropped.next > 0) unlink(dropped.backends[c]);
+		}
+	}
+
+	void link(int fd) {
+		if ( (size_t) fd >= m_links.size() ) m_links.resize(fd + 1);
+		Link& link = m_links[fd];
+		link.open = true;
+		link.connecting = false;
+		link.peer = -1;
+		link.game = 0;
+		link.pending.clear();
+		link.output.clear();
+	}
+
+	void unlink(int fd) {
+		if (!m_links[fd].open) return;
+		close(fd);
+		m_links[fd].open = false;
+		m_links[fd].pending.clear();
+		m_links[fd].output.clear();
+	}
+
+	// Messages are small and each one is waited for, so relaying must not
+	// hold them back for coalescing.
+	void watch(int fd, uint32_t events = EPOLLIN) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		struct epoll_event ev;
+		ev.events = events;
+		ev.data.fd = fd;
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	void interest(int fd, uint32_t events) {
+		struct epoll_event ev;
+		ev.events = events;
+		ev.data.fd = fd;
+		epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &ev);
+	}
+
+	void send(int fd, const string& message) {
+		send( fd, message.c_str(), message.size() + 1 );
+	}
+
+	// Writes what the socket takes now and queues the rest behind what is
+	// already queued. A peer that lets more than s_max_output pile up is
+	// not reading, and its relay is dropped rather than buffered forever.
+	void send(int fd, const char *data, size_t size) {
+		Link& link = m_links[fd];
+		if (!link.open || size == 0) return;
+		if ( link.output.empty() ) {
+			ssize_t n = write(fd, data, size);
+			if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				drop(fd);
+				return;
+			}
+			if (n > 0) {
+				data += n;
+				size -= n;
+			}
+			if (size == 0) return;
+			interest(fd, EPOLLIN | EPOLLOUT);
+		}
+		if (link.output.size() + size > s_max_output) {
+			drop(fd);
+			return;
+		}
+		link.output.append(data, size);
+	}
+
+	static void resolve(const string& node, sockaddr_in& address) {
+		memset(&address, 0, sizeof address);
+		size_t colon = node.rfind(':');
+		if (colon == string::npos) return;
+		struct addrinfo hints, *addresses;
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(node.substr(0, colon).c_str(), node.c_str() + colon + 1, &hints, &addresses) != 0) return;
+		memcpy(&address, addresses->ai_addr, sizeof address);
+		freeaddrinfo(addresses);
+	}
+
+	// Starts a connection, which completes or fails on EPOLLOUT.
+	static int connect_backend(const sockaddr_in& address) {
+		if (address.sin_family != AF_INET) return -1;
+		int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if ( fd >= 0 && connect(fd, (const struct sockaddr*) &address, sizeof address) < 0 && errno != EINPROGRESS ) {
+			close(fd);
+			fd = -1;
+		}
+		return fd;
+	}
+
+	// Games routed to each backend, on SIGUSR1.
+	void dump_stats() {
+		for (size_t i = 0; i < m_ring.size(); ++i)
+			fprintf(stderr, "%s %llu games\n", m_ring.node(i).c_str(), (unsigned long long) m_routed[i]);
+	}
+
+	int create_socket() {
+		struct sockaddr_in sa;
+		int fd = socket(PF_INET, SOCK_STREAM, 0);
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(m_port);
+		sa.sin_addr.s_addr = htonl(INADDR_ANY);
+		bind(fd, (struct sockaddr*) &sa, sizeof sa);
+		listen(fd, s_listen);
+		return fd;
+	}
+};
+
+int main(int argc, char *argv[]) {
+	int port = s_default_port;
+	int opt;
+	while ( (opt = getopt(argc, argv, "p:")) != -1 ) {
+		if (opt == 'p') port = atoi(optarg);
+		else break;
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-p port] backends.txt\n", argv[0]);
+		return 1;
+	}
+	Proxy proxy(argv[optind], port);
+	if ( !proxy.load_backends() ) {
+		fprintf(stderr, "%s: no backends\n", argv[optind]);
+		return 1;
+	}
+	proxy.run();
+	return 0;
+}
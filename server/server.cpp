@@ -2,61 +2,324 @@
 #include <sys/epoll.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <csignal>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include "archive.hpp"
+#include "batch.hpp"
 #include "chess.hpp"
+#include "book.hpp"
+#include "event_log.hpp"
+#include "game_record.hpp"
+#include "handoff.hpp"
+#include "history.hpp"
+#include "move_cache.hpp"
+#include "position_index.hpp"
+#include "protocol.hpp"
 
 using namespace std;
 
+static volatile sig_atomic_t s_dump_stats = 0;
+
+static void request_stats(int) { s_dump_stats = 1; }
+
+static int64_t monotonic_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// A game between requests is a GameRecord in the server's slab. Game
+// unpacks it into the server's scratch position for one request and packs
+// it back whenever a move changes it. Engine is the rules engine of the
+// game's variant, Chess or Chess960.
+template <class Engine>
 class Game {
-	vector<int> m_players;
-	Chess 		m_game;
+	GameRecord&			m_record;
+	Engine&				m_game;
+	History&			m_history;
+	const Book			*m_book;
+	const PositionIndex	*m_index;
+	EventLog			*m_log;
+	MoveCache			*m_cache;
+	uint32_t			m_trace;
 
 public:
-	Game() {}
-	
-	void add(int fd) {
-		m_players.push_back(fd);
+	enum { LOST_ON_TIME = Chess::INSUFFICIENT_MATERIAL + 1, DISCONNECTED };
+
+	Game(GameRecord& record, Engine& scratch, History& history, const Book *book = NULL, EventLog *log = NULL,
+			const PositionIndex *index = NULL, MoveCache *cache = NULL)
+		: m_record(record), m_game(scratch), m_history(history) {
+		m_book = book;
+		m_index = index;
+		m_log = log;
+		m_cache = cache;
+		m_trace = 0;
 	}
 	
-	void setup() {
+	// clock_ms is each player's time for the whole game, 0 for none.
+	void setup(int white, int black, int32_t clock_ms, int64_t now) {
+		m_record.players[Chess::WHITE] = white;
+		m_record.players[Chess::BLACK] = black;
+		m_record.clocks[Chess::WHITE] = m_record.clocks[Chess::BLACK] = clock_ms;
+		m_record.timed = (clock_ms > 0);
+		m_record.last_move = now;
+		m_game.set_start(m_record.start);
 		m_game.setup();
-		int active = m_players[m_game.turn()];
-		send("setup");
-		send(active, "your turn");
+		m_record.history = m_history.root(m_game);
+		save();
+		int active = m_record.players[m_game.turn()];
+		LegalMoves legal;
+		legal_moves(legal);
+		send(s_msg_setup);
+		send_position();
+		send_legal(active, legal);
+		send(active, s_msg_your_turn);
 	}
 	
-	void accept_move(int fd, string move) {
-		int active = m_players[m_game.turn()];
+	// Returns true once the move has ended the game. lag is the mover's
+	// round-trip time, half of which is not charged to their clock. verdict
+	// is what a MoveBatch found for the move, or -1 if it has not seen it.
+	// Events are logged under trace.
+	bool accept_move(int fd, string move, int64_t now, int64_t lag = 0, uint32_t trace = 0, int verdict = -1) {
+		m_trace = trace;
+		if ( has_prefix(move.c_str(), s_prefix_replay) ) {
+			send_replay( fd, atoi(move.c_str() + strlen(s_prefix_replay)) );
+			return false;
+		}
+		load();
+		if (move == s_msg_book) {
+			send_book(fd);
+			return false;
+		}
+		if (move == s_msg_games) {
+			send_games(fd);
+			return false;
+		}
+		
+		int turn = m_game.turn();
+		int active = m_record.players[turn];
 		
 		if (fd != active) {
-			send(fd, "not your turn");
-			return;
+			send(fd, s_msg_not_your_turn);
+			return false;
+		}
+		if ( time_left(now - lag / 2) <= 0 ) {
+			lose_on_time();
+			return true;
 		}
 		
-		switch ( m_game.enter_move(move.c_str()) ) {
+		// A move the batch has not seen is checked against the cached moves
+		// of the position, except for the second half of a promotion.
+		LegalMoves legal;
+		Move parsed;
+		bool named = move[0] != '=' && m_game.parse_move(move.c_str(), parsed);
+		if (verdict < 0 && named) {
+			legal_moves(legal);
+			verdict = legal.contains(parsed);
+		}
+		int status;
+		if (verdict < 0) {
+			status = m_game.enter_move( move.c_str() );
+		} else if (verdict == 0) {
+			status = Chess::INVALID_MOVE;
+		} else {
+			status = m_game.enter_move(parsed, true);
+		}
+		if (m_log != NULL) m_log->log(EVENT_VALIDATED, fd, trace, status);
+		switch (status) {
 			case 0: case 1:
+				record(move, parsed, turn);
+				charge(turn, now - lag / 2);
+				save();
 				send(move);
+				send_position();
+				send_clocks();
+				legal_moves(legal);
+				if ( game_over(legal) ) return true;
 				break;
 			case 2:
+				m_record.pending = parsed.code();
+				save();
 				send(move);
-				break;
+				send(fd, s_msg_your_turn);
+				return false;
 			default:
-				send(fd, "invalid move");
+				send(fd, s_msg_invalid_move);
+				legal_moves(legal);
 		}
 
-		int next = m_players[m_game.turn()];
-		send(next, "your turn");
+		int next = m_record.players[m_game.turn()];
+		send_legal(next, legal);
+		send(next, s_msg_your_turn);
+		return false;
+	}
+	
+	// Milliseconds the player to move would have left at time now.
+	int64_t time_left(int64_t now) const {
+		if (!m_record.timed) return INT64_MAX;
+		int turn = m_record.position.turn;
+		return m_record.clocks[turn] - max<int64_t>(now - m_record.last_move, 0) / 1000;
+	}
+	
+	void lose_on_time() {
+		if (m_log != NULL) m_log->log(EVENT_GAME_OVER, -1, m_trace, LOST_ON_TIME);
+		finish( (m_record.position.turn == Chess::WHITE) ? "0-1" : "1-0", "time" );
+	}
+	
+	// The player on fd has gone, so the other one wins.
+	void forfeit(int fd) {
+		if (m_log != NULL) m_log->log(EVENT_GAME_OVER, fd, m_trace, DISCONNECTED);
+		finish( (fd == m_record.players[Chess::WHITE]) ? "0-1" : "1-0", "disconnect" );
+	}
+	
+	// "replay <ply> <fen>": the position after the first ply moves.
+	void send_replay(int fd, int ply) {
+		if (ply < 0) ply = 0;
+		if (ply > m_record.ply) ply = m_record.ply;
+		Engine chess;
+		chess.set_start(m_record.start);
+		m_history.position(m_record.history, ply, chess);
+		char fen[Chess::FEN_SIZE];
+		chess.to_fen(fen);
+		send(fd, s_prefix_replay + to_string(ply) + " " + fen);
+	}
+	
+	void send_position() {
+		char fen[Chess::FEN_SIZE];
+		m_game.to_fen(fen);
+		send(string(s_prefix_fen) + fen);
+	}
+	
+	// "clock <white ms> <black ms>" after each move of a timed game.
+	void send_clocks() {
+		if (!m_record.timed) return;
+		send( s_prefix_clock + to_string(m_record.clocks[Chess::WHITE]) + " " +
+			to_string(m_record.clocks[Chess::BLACK]) );
+	}
+	
+	// "legal e2:0000000000101000 ...": for each piece that can move, a mask
+	// of its target squares with bit n standing for Point::index() n.
+	void send_legal(int fd, const LegalMoves& legal) {
+		uint64_t targets[64];
+		memset(targets, 0, sizeof targets);
+		for (int i = 0; i < legal.count; ++i)
+			targets[ legal.moves[i].from().index() ] |= (uint64_t) 1 << legal.moves[i].to().index();
+		string response = s_prefix_legal;
+		for (int i = 0; i < 64; ++i) {
+			if (targets[i] == 0) continue;
+			char square[3], entry[24];
+			Point(i / 8, i % 8).to_string(square);
+			snprintf(entry, sizeof entry, " %s:%016llx", square, (unsigned long long) targets[i]);
+			response += entry;
+		}
+		send(fd, response);
+	}
+	
+	bool game_over(const LegalMoves& legal) {
+		static const char *reasons[] = {
+			"", "checkmate", "stalemate", "fifty moves", "repetition", "insufficient material"
+		};
+		int status = legal.game_status(m_game);
+		if (status == Chess::IN_PROGRESS) return false;
+		if (m_log != NULL) m_log->log(EVENT_GAME_OVER, -1, m_trace, status);
+		string result = "1/2-1/2";
+		if (status == Chess::CHECKMATE) result = (m_game.turn() == Chess::WHITE) ? "0-1" : "1-0";
+		finish(result, reasons[status]);
+		return true;
 	}
 	
-	int player1() const { return m_players[0]; }
-	int player2() const { return m_players[1]; }
-	int other(int fd) const { return m_players[0] ^ m_players[1] ^ fd; }
+	void send_book(int fd) {
+		string response = s_msg_book;
+		const BookEntry *entries;
+		int n = (m_book != NULL) ? m_book->probe(m_game.hash(), &entries) : 0;
+		for (int i = 0; i < n; ++i) {
+			char move[8];
+			Move::from_code(entries[i].move).to_string(move);
+			response += ' ';
+			response += move;
+			response += ':';
+			response += to_string(entries[i].weight);
+		}
+		send(fd, response);
+	}
+	
+	// "games 1234:17 ...": archived games that reached the current position,
+	// each with the ply it was reached at, oldest first.
+	void send_games(int fd) {
+		static const size_t s_max_games = 32;
+		string response = s_msg_games;
+		vector<IndexHit> hits;
+		if (m_index != NULL) m_index->lookup(m_game.hash(), hits, s_max_games);
+		for (size_t i = 0; i < hits.size(); ++i)
+			response += ' ' + to_string(hits[i].game) + ':' + to_string(hits[i].ply);
+		send(fd, response);
+	}
+	
+	int player1() const { return m_record.players[0]; }
+	int player2() const { return m_record.players[1]; }
+	int other(int fd) const { return m_record.players[0] ^ m_record.players[1] ^ fd; }
 	
 private:
+	// The record keeps the last RECENT keys for the repetition check. After
+	// more reversible plies than that the older ones come from History.
+	void load() {
+		m_game.set_start(m_record.start);
+		int n = min(m_record.position.halfmove + 1, (int) Chess::HISTORY_SIZE);
+		if (n <= m_record.recent_size) {
+			m_game.unpack(m_record.position, m_record.recent, m_record.recent_size);
+			return;
+		}
+		uint64_t keys[Chess::HISTORY_SIZE];
+		m_game.unpack( m_record.position, keys, m_history.keys(m_record.history, n, keys) );
+	}
+	
+	// The legal moves of the current position, from the cache if there is one.
+	void legal_moves(LegalMoves& legal) {
+		if (m_cache != NULL) m_cache->get(m_game, legal);
+		else legal.generate(m_game);
+	}
+	
+	void save() {
+		m_game.pack(m_record.position);
+		m_record.recent_size = (uint8_t) m_game.history(m_record.recent, GameRecord::RECENT);
+	}
+	
+	// Takes the time since the last move off the clock of turn.
+	void charge(int turn, int64_t now) {
+		if (m_record.timed) m_record.clocks[turn] -= (int32_t) ( max<int64_t>(now - m_record.last_move, 0) / 1000 );
+		m_record.last_move = max(now, m_record.last_move);
+	}
+	
+	// A promotion sent as "e7e8" followed by "=Q" is recorded as one move.
+	// Any other move is recorded as parsed before it was played.
+	void record(const string& move, const Move& parsed, int turn) {
+		Move played = parsed;
+		if (move[0] == '=') {
+			char promotion[8];
+			Move::from_code(m_record.pending).to_string(promotion);
+			played.from_string( (promotion + string(1, move[1])).c_str(), turn );
+		}
+		m_record.history = m_history.push(m_record.history, played, m_game);
+		m_record.ply = (uint16_t) m_history.depth(m_record.history);
+	}
+	
+	void finish(const string& result, const char *reason) {
+		m_record.result = (result == "1-0") ? ARCHIVE_WHITE_WINS : (result == "0-1") ? ARCHIVE_BLACK_WINS : ARCHIVE_DRAW;
+		send(string(s_prefix_game_over) + " " + result + " " + reason);
+	}
+	
 	void send(string response) {
-		write(m_players[0], response.c_str(), response.size() + 1);
-		write(m_players[1], response.c_str(), response.size() + 1);
+		write(m_record.players[0], response.c_str(), response.size() + 1);
+		write(m_record.players[1], response.c_str(), response.size() + 1);
 	}
 	
 	void send(int fd, string response) {
@@ -65,60 +328,238 @@ private:
 };
 
 class Client {
-	int		m_fd;
-	Game	*m_game;
+	// Each message costs s_message_cost microseconds of credit, which comes
+	// back at one per microsecond up to s_burst messages' worth: twenty
+	// messages a second, far above what a player sends.
+	static const int64_t s_message_cost = 50000;
+	static const int64_t s_burst = 32;
+	int				m_fd;
+	uint32_t		m_game;
+	FrameDecoder	m_decoder;
+	int64_t			m_rtt;
+	int64_t			m_credit;
+	int64_t			m_refilled;
+	int64_t			m_paused_until;	// -1 while the socket is read
+	uint64_t		m_throttled;
 
 public:
-	Client(int fd) { m_fd = fd; }
+	Client(int fd) {
+		m_fd = fd;
+		m_game = GameSlab::NONE;
+		m_rtt = -1;
+		m_credit = s_burst * s_message_cost;
+		m_refilled = monotonic_us();
+		m_paused_until = -1;
+		m_throttled = 0;
+	}
+	
+	void send(string message) {
+		write(m_fd, message.c_str(), message.size() + 1);
+	}
+	
+	void ping(int64_t now) {
+		send(s_prefix_ping + to_string(now));
+	}
 	
-	void join_game(Game *game) {
-		game->add(m_fd);
+	// Answers "ping <t>" with "pong <t> <now>", and folds the round trip of
+	// a "pong <t> ..." answering our own ping into the smoothed RTT.
+	// Returns false if the message is neither.
+	bool on_probe(const string& message, int64_t now) {
+		const char *arg = message.c_str() + strlen(s_prefix_ping);
+		if ( has_prefix(message.c_str(), s_prefix_ping) ) {
+			send(s_prefix_pong + string(arg) + " " + to_string(now));
+			return true;
+		}
+		if ( !has_prefix(message.c_str(), s_prefix_pong) ) return false;
+		int64_t sample = now - strtoll(arg, NULL, 10);
+		if (sample < 0) return true;
+		m_rtt = (m_rtt < 0) ? sample : m_rtt + (sample - m_rtt) / 8;
+		return true;
+	}
+	
+	void join_game(uint32_t game) {
 		m_game = game;
 	}
 	
-	void make_move(string move) {
-		m_game->accept_move(m_fd, move);
+	void leave_game() {
+		m_game = GameSlab::NONE;
+	}
+	
+	// Picks up where the same client left off in another process.
+	void resume(uint32_t game, int64_t rtt, const string& unread) {
+		m_game = game;
+		m_rtt = rtt;
+		m_decoder.feed( unread.data(), unread.size() );
 	}
 	
-	Game *game() const { return m_game; }
+	// Takes one message's credit from the token bucket, if it holds that much.
+	bool admit(int64_t now) {
+		m_credit = min(m_credit + max<int64_t>(now - m_refilled, 0), s_burst * s_message_cost);
+		m_refilled = max(now, m_refilled);
+		if (m_credit >= s_message_cost) {
+			m_credit -= s_message_cost;
+			return true;
+		}
+		++m_throttled;
+		return false;
+	}
+	
+	// When admit() will next succeed.
+	int64_t admit_at() const { return m_refilled + s_message_cost - m_credit; }
+	
+	void pause(int64_t until) { m_paused_until = until; }
+	void resume() { m_paused_until = -1; }
+	
+	uint32_t game() const { return m_game; }
+	int fd() const { return m_fd; }
+	int64_t paused_until() const { return m_paused_until; }
+	uint64_t throttled() const { return m_throttled; }
+	FrameDecoder& decoder() { return m_decoder; }
+	int64_t rtt() const { return m_rtt; }
+};
+
+// A message read during the current tick, waiting for the tick's moves to
+// be validated together.
+struct Request {
+	int			fd;
+	uint32_t	trace;
+	int			verdict;
+	string		text;
+};
+
+// The first of a routed game's two connections to arrive.
+struct Join {
+	int		fd;
+	bool	white;
 };
 
 class Server {
 	static const int s_max_events = 64;
 	static const int s_max_clients = 32;
-	static const int s_port = 3000;
 	static const int s_listen = 10;
+	static const int64_t s_ping_interval = 2000000;
+	static const int64_t s_archive_interval = 60000000;
+	static const size_t s_max_queue = 64;
+	static const size_t s_move_cache_mb = 16;
 	Client			*m_clients[s_max_clients];
-	vector<Game*>	m_games;
+	GameSlab		m_games;
+	History			m_history;
+	Chess			m_scratch;
+	Chess960		m_scratch960;
+	int32_t			m_clock_ms;
+	bool			m_chess960;
 	Client			*m_waiting;
+	int				m_port;
+	bool			m_routed;
+	int				m_epoll;
+	unordered_map<uint64_t, Join>	m_joins;
+	vector<Request>	m_requests;
+	MoveBatch		m_batch;
+	MoveCache		m_moves;
+	Book			m_book;
+	EventLog		m_log;
+	ArchiveWriter	m_archive;
+	PositionIndexWriter	m_indexer;
+	PositionIndexWriter::Batch	m_index_batch;	// being written by m_index_thread
+	thread			m_index_thread;
+	atomic<bool>	m_index_written;
+	bool			m_index_ok;
+	PositionIndex	m_index;
+	string			m_index_path;
+	uint32_t		m_trace;
 
 public:
-	Server() {
+	// clock_ms is each player's time for a whole game, 0 for untimed games.
+	// A routed server sits behind a proxy and pairs connections by the
+	// "join <game> <colour>" each one opens with, not by arrival. With
+	// chess960 every new game starts from a random Chess960 position.
+	Server(int32_t clock_ms = 0, int port = s_default_port, bool routed = false, bool chess960 = false)
+		: m_moves(s_move_cache_mb), m_indexer(&m_moves) {
+		m_clock_ms = clock_ms;
+		m_chess960 = chess960;
+		m_port = port;
+		m_routed = routed;
+		m_epoll = -1;
 		m_waiting = NULL;
+		m_trace = 0;
+		m_index_written = false;
+		m_index_ok = true;
 		for (int i = 0; i < s_max_clients; i++) m_clients[i] = NULL;
 	}
 
-	void run() {
-		int fd = create_socket();
-		int efd = epoll_create1(0);
-		struct epoll_event ev;
-		ev.events = EPOLLIN;
-		ev.data.fd = fd;
-		epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+	// Finished games are appended to archive_path, if given, and indexed by
+	// position in index_path. With handoff_path the server first takes over
+	// from a server listening there, if any, and then listens there itself
+	// for the process that will take over from it.
+	void run(const char *log_path = NULL, const char *archive_path = NULL, const char *index_path = NULL,
+			const char *handoff_path = NULL) {
+		m_book.open("book.bin");
+		if ( log_path != NULL && !m_log.open(log_path) ) perror(log_path);
+		// The old process flushes the archive as it hands off, so open it after.
+		int fd = (handoff_path != NULL) ? take_over(handoff_path) : -1;
+		if ( archive_path != NULL && !m_archive.open(archive_path) ) perror(archive_path);
+		if ( m_archive.is_open() && index_path != NULL ) open_index(archive_path, index_path);
+		if (fd < 0) fd = create_socket();
+		int hfd = (handoff_path != NULL) ? handoff_socket(handoff_path, true) : -1;
+		if (handoff_path != NULL && hfd < 0) perror(handoff_path);
+		m_epoll = epoll_create1(0);
+		watch(fd);
+		if (hfd >= 0) watch(hfd);
+		// Taken-over clients are watched from the first tick, which also
+		// queues whatever complete messages they brought along.
+		for (int i = 0; i < s_max_clients; i++)
+			if (m_clients[i] != NULL) m_clients[i]->pause(0);
+		signal(SIGPIPE, SIG_IGN);
+		signal(SIGUSR1, request_stats);
+		int64_t next_ping = monotonic_us() + s_ping_interval;
+		int64_t next_archive = monotonic_us() + s_archive_interval;
+		int successor = -1;
 		for (;;) {
 			struct epoll_event events[s_max_events];
-			int nevents = epoll_wait(efd, events, s_max_events, -1);
+			int64_t now = monotonic_us();
+			if (now >= next_ping) {
+				ping_all(now);
+				check_clocks(now);
+				next_ping = now + s_ping_interval;
+			}
+			if (now >= next_archive) {
+				m_archive.flush();
+				update_index();
+				next_archive = now + s_archive_interval;
+			}
+			if (m_index_written) finish_index();
+			if (s_dump_stats) {
+				dump_stats();
+				s_dump_stats = 0;
+			}
+			int64_t wake = min( next_ping, next_resume() );
+			int timeout = (int) ( (max<int64_t>(wake - now, 0) + 999) / 1000 );
+			int nevents = epoll_wait(m_epoll, events, s_max_events, timeout);
+			m_requests.clear();
+			resume_clients( monotonic_us() );
 			for (int n = 0; n < nevents; n++) {
 				if (events[n].data.fd == fd) {
 					int conn = accept(fd, NULL, NULL);
-					ev.events = EPOLLIN;
-					ev.data.fd = conn;
-					epoll_ctl(efd, EPOLL_CTL_ADD, conn, &ev);
+					watch(conn);
 					on_connect(conn);
+				} else if (events[n].data.fd == hfd) {
+					successor = accept(hfd, NULL, NULL);
 				} else {
-					on_request(events[n].data.fd);
+					on_read(events[n].data.fd);
 				}
 			}
+			validate_moves();
+			for (size_t i = 0; i < m_requests.size(); ++i) on_request(m_requests[i]);
+			for (int n = 0; n < nevents; n++) {
+				int conn = events[n].data.fd;
+				if (conn != fd && conn != hfd && m_clients[conn] != NULL && m_clients[conn]->decoder().overflow())
+					disconnect(conn);
+			}
+			// Between ticks, so no request is half done.
+			if (successor >= 0) {
+				if ( hand_off(successor, fd) ) return;
+				successor = -1;
+			}
 		}
 	}
 
@@ -126,40 +567,515 @@ private:
 	void on_connect(int fd) {
 		if (fd >= s_max_clients) {
 			write(fd, "server is full", 15);
+			close(fd);
 			return;
 		}
 		
 		Client *client = new Client(fd);
 		m_clients[fd] = client;
-		
+		m_log.log(EVENT_ACCEPT, fd, 0);
+		if (!m_routed) pair(client);
+	}
+	
+	// Starts a game between client and the one waiting, if any, or leaves
+	// client waiting.
+	void pair(Client *client) {
 		if (m_waiting == NULL) {
 			m_waiting = client;
 			return;
 		}
 		
-		Game *game = new Game;
-		m_waiting->join_game(game);
-		client->join_game(game);
-		m_games.push_back(game);
-		game->setup();
+		uint32_t id = m_games.create();
+		m_waiting->join_game(id);
+		client->join_game(id);
+		start_game( id, client->fd(), m_waiting->fd() );
 		m_waiting = NULL;
 	}
 	
-	void on_request(int fd) {
-		char request[64];
+	// A message split across reads waits in the client's decoder.
+	void on_read(int fd) {
+		char data[512];
 		Client *client = m_clients[fd];
-		if (read(fd, request, sizeof request) > 0) {
-			client->make_move(request);
+		ssize_t size = read(fd, data, sizeof data);
+		if (size <= 0) {
+			disconnect(fd);
+			return;
+		}
+		client->decoder().feed(data, size);
+		queue_requests( client, monotonic_us() );
+	}
+	
+	// Queues the client's complete messages for this tick, answering probes
+	// at once, while its token bucket and the tick's queue have room. The
+	// rest stay in its decoder and its socket is not read until they can
+	// be queued, so a client that floods the server is held back by TCP
+	// and costs the others nothing but a few admit() calls.
+	void queue_requests(Client *client, int64_t now) {
+		FrameDecoder& decoder = client->decoder();
+		int fd = client->fd();
+		Request request;
+		while ( decoder.ready() ) {
+			if (m_requests.size() >= s_max_queue) {
+				pause(client, now);
+				return;
+			}
+			if ( !client->admit(now) ) {
+				pause( client, client->admit_at() );
+				return;
+			}
+			decoder.next(request.text);
+			if ( client->on_probe(request.text, now) ) continue;
+			if (client->game() == GameSlab::NONE) {
+				if ( m_routed && has_prefix(request.text.c_str(), s_prefix_join) ) on_join(client, request.text);
+				continue;
+			}
+			request.fd = fd;
+			request.trace = ++m_trace;
+			request.verdict = -1;
+			m_log.log( EVENT_REQUEST, fd, request.trace, 0, request.text.c_str() );
+			if ( reject(fd, request.text) ) m_log.log(EVENT_BROADCAST, fd, request.trace);
+			else m_requests.push_back(request);
+		}
+	}
+	
+	// Answers what the game record alone shows to be wrong, without
+	// unpacking the position: a move out of turn, or one naming no squares.
+	bool reject(int fd, const string& text) {
+		if ( text == s_msg_book || text == s_msg_games || has_prefix(text.c_str(), s_prefix_replay) ) return false;
+		const GameRecord& record = m_games[ m_clients[fd]->game() ];
+		int turn = record.position.turn;
+		Move move;
+		if (record.players[turn] != fd) {
+			m_clients[fd]->send(s_msg_not_your_turn);
+		} else if ( text[0] != '=' && !move.from_string(text.c_str(), turn) ) {
+			m_clients[fd]->send(s_msg_invalid_move);
 		} else {
-			close(fd);
+			return false;
+		}
+		return true;
+	}
+	
+	// Stops reading the client's socket until the first tick at or after
+	// until.
+	void pause(Client *client, int64_t until) {
+		if (client->paused_until() < 0) epoll_ctl(m_epoll, EPOLL_CTL_DEL, client->fd(), NULL);
+		client->pause(until);
+	}
+	
+	// Watches the sockets of paused clients whose time has come again,
+	// queueing the messages they left in their decoders first.
+	void resume_clients(int64_t now) {
+		for (int i = 0; i < s_max_clients; i++) {
+			Client *client = m_clients[i];
+			if (client == NULL || client->paused_until() < 0 || client->paused_until() > now) continue;
+			client->resume();
+			watch(i);
+			queue_requests(client, now);
+		}
+	}
+	
+	int64_t next_resume() const {
+		int64_t next = INT64_MAX;
+		for (int i = 0; i < s_max_clients; i++)
+			if (m_clients[i] != NULL && m_clients[i]->paused_until() >= 0) next = min( next, m_clients[i]->paused_until() );
+		return next;
+	}
+	
+	// "join <game> <white|black>": the game starts once both colours joined.
+	// A connection may wait on one join at a time, and a colour already
+	// taken, or neither colour, is answered with "invalid join".
+	void on_join(Client *client, const string& message) {
+		unsigned long long id;
+		char colour[8];
+		if ( sscanf(message.c_str() + strlen(s_prefix_join), "%llu %7s", &id, colour) != 2 ||
+				(strcmp(colour, "white") != 0 && strcmp(colour, "black") != 0) ) {
+			client->send(s_msg_invalid_join);
+			return;
+		}
+		Join join = { client->fd(), strcmp(colour, "white") == 0 };
+		for (unordered_map<uint64_t, Join>::iterator it = m_joins.begin(); it != m_joins.end(); ++it) {
+			if (it->second.fd != join.fd) continue;
+			client->send(s_msg_invalid_join);
+			return;
+		}
+		unordered_map<uint64_t, Join>::iterator other = m_joins.find(id);
+		if ( other == m_joins.end() ) {
+			m_joins[id] = join;
+			return;
+		}
+		if (other->second.white == join.white) {
+			client->send(s_msg_invalid_join);
+			return;
 		}
+		int white = join.white ? join.fd : other->second.fd;
+		int black = join.white ? other->second.fd : join.fd;
+		m_joins.erase(other);
+		uint32_t game_id = m_games.create();
+		m_clients[white]->join_game(game_id);
+		m_clients[black]->join_game(game_id);
+		start_game(game_id, white, black);
+	}
+	
+	void start_game(uint32_t id, int white, int black) {
+		GameRecord& record = m_games[id];
+		if (m_chess960) {
+			record.variant = VARIANT_CHESS960;
+			record.start = (uint16_t) ( rand() % Chess960::POSITIONS );
+			game(id, m_scratch960).setup( white, black, m_clock_ms, monotonic_us() );
+		} else {
+			game(id, m_scratch).setup( white, black, m_clock_ms, monotonic_us() );
+		}
+	}
+	
+	// Checks the tick's moves in one batch: for each game, the first queued
+	// move from the player in turn. Later ones are checked against the
+	// position that move leads to, so they take the usual path, as do the
+	// moves of Chess960 games, whose castling MoveBatch does not know.
+	void validate_moves() {
+		unordered_set<uint32_t> seen;
+		vector<size_t> batched;
+		m_batch.reset( m_requests.size() );
+		for (size_t i = 0; i < m_requests.size(); ++i) {
+			Request& request = m_requests[i];
+			Client *client = m_clients[request.fd];
+			// The game may have ended on a disconnect earlier in the tick.
+			if (client == NULL || client->game() == GameSlab::NONE) continue;
+			uint32_t id = client->game();
+			const GameRecord& record = m_games[id];
+			Move move;
+			if ( record.variant != VARIANT_STANDARD ||
+					record.players[record.position.turn] != request.fd || record.position.to_promote >= 0 ||
+					!move.from_string(request.text.c_str(), record.position.turn) || !seen.insert(id).second ) continue;
+			m_batch.add(record.position, move);
+			batched.push_back(i);
+		}
+		if ( batched.empty() ) return;
+		vector<uint8_t> legal( batched.size() );
+		m_batch.validate( legal.data() );
+		for (size_t i = 0; i < batched.size(); ++i) m_requests[ batched[i] ].verdict = legal[i];
+	}
+	
+	void on_request(const Request& request) {
+		Client *client = m_clients[request.fd];
+		if (client == NULL || client->game() == GameSlab::NONE) return;
+		uint32_t id = client->game();
+		bool finished = (m_games[id].variant == VARIANT_CHESS960) ? play(game(id, m_scratch960), request, client)
+			: play(game(id, m_scratch), request, client);
+		m_log.log(EVENT_BROADCAST, request.fd, request.trace);
+		if (finished) end_game(id);
+	}
+	
+	template <class Engine> bool play(Game<Engine> view, const Request& request, const Client *client) {
+		return view.accept_move( request.fd, request.text, monotonic_us(), max<int64_t>(client->rtt(), 0),
+			request.trace, request.verdict );
+	}
+	
+	// A player who leaves a game loses it, so no game outlives the fd of
+	// either player and a new connection given the same fd starts afresh.
+	void disconnect(int fd) {
+		Client *client = m_clients[fd];
+		uint32_t id = client->game();
+		if (id != GameSlab::NONE) {
+			players(id).forfeit(fd);
+			end_game(id);
+		}
+		// A handed-over fd may share its file with the old process, which
+		// would keep it in the epoll set past close().
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, NULL);
+		close(fd);
+		m_log.log(EVENT_CLOSE, fd, 0);
+		if (client == m_waiting) m_waiting = NULL;
+		for (unordered_map<uint64_t, Join>::iterator it = m_joins.begin(); it != m_joins.end(); ++it) {
+			if (it->second.fd != fd) continue;
+			m_joins.erase(it);
+			break;
+		}
+		m_clients[fd] = NULL;
+		delete client;
+	}
+	
+	void ping_all(int64_t now) {
+		for (int i = 0; i < s_max_clients; i++)
+			if (m_clients[i] != NULL) m_clients[i]->ping(now);
+	}
+	
+	// Smoothed round-trip time of each connection and the times it ran out
+	// of credit, and the move cache's hit count, on SIGUSR1.
+	void dump_stats() {
+		uint64_t hits, misses;
+		m_moves.stats(hits, misses);
+		fprintf(stderr, "move cache %llu hits %llu misses\n", (unsigned long long) hits, (unsigned long long) misses);
+		for (int i = 0; i < s_max_clients; i++) {
+			if (m_clients[i] == NULL) continue;
+			int64_t rtt = m_clients[i]->rtt();
+			unsigned long long throttled = m_clients[i]->throttled();
+			if (rtt < 0) fprintf(stderr, "fd %d rtt - throttled %llu\n", i, throttled);
+			else fprintf(stderr, "fd %d rtt %.1f ms throttled %llu\n", i, rtt / 1000.0, throttled);
+		}
+	}
+	
+	// A player whose flag falls while the opponent is waiting loses here
+	// rather than on their next move.
+	void check_clocks(int64_t now) {
+		for (uint32_t id = 0; id < m_games.capacity(); ++id) {
+			const GameRecord& record = m_games[id];
+			if (!record.in_use || !record.timed) continue;
+			Game<Chess> view = players(id);
+			if (view.time_left(now) > 0) continue;
+			view.lose_on_time();
+			end_game(id);
+		}
+	}
+	
+	// scratch must be the engine of the game's variant.
+	template <class Engine> Game<Engine> game(uint32_t id, Engine& scratch) {
+		return Game<Engine>(m_games[id], scratch, m_history, &m_book, &m_log, &m_index, &m_moves);
+	}
+	
+	// For what leaves the position alone, the players and their clocks,
+	// any game's view will do.
+	Game<Chess> players(uint32_t id) { return game(id, m_scratch); }
+	
+	void end_game(uint32_t id) {
+		Game<Chess> view = players(id);
+		m_clients[view.player1()]->leave_game();
+		m_clients[view.player2()]->leave_game();
+		if ( m_archive.is_open() ) archive(m_games[id]);
+		m_history.release(m_games[id].history);
+		m_games.release(id);
 	}
 
-	static int create_socket() {
+	// Sends the listening socket, the open connections and the games between
+	// them to the process that connected to the handoff socket as conn, and
+	// returns true once it has taken them over.
+	bool hand_off(int conn, int listen_fd) {
+		m_archive.flush();
+		// The successor reads the index from disk, so it waits for both
+		// the batch being written and the one left.
+		finish_index();
+		update_index();
+		finish_index();
+		vector<int> fds(1, listen_fd);
+		for (int i = 0; i < s_max_clients; i++)
+			if (m_clients[i] != NULL) fds.push_back(i);
+		vector<uint32_t> games;
+		for (uint32_t id = 0; id < m_games.capacity(); ++id)
+			if (m_games[id].in_use) games.push_back(id);
+		HandoffWriter out;
+		out.put(s_handoff_magic);
+		out.put<uint32_t>( (uint32_t) fds.size() - 1 );
+		out.put<uint32_t>( (uint32_t) games.size() );
+		out.put<uint32_t>( (uint32_t) m_joins.size() );
+		out.put<int32_t>(m_waiting != NULL ? m_waiting->fd() : -1);
+		out.put<uint32_t>(m_trace);
+		for (size_t i = 1; i < fds.size(); ++i) {
+			Client *client = m_clients[ fds[i] ];
+			out.put<int32_t>(fds[i]);
+			out.put<uint32_t>( client->game() );
+			out.put<int64_t>( client->rtt() );
+			out.put_string( client->decoder().unread() );
+		}
+		for (size_t i = 0; i < games.size(); ++i) {
+			const GameRecord& record = m_games[ games[i] ];
+			vector<Move> played;
+			m_history.moves(record.history, played);
+			out.put<uint32_t>(games[i]);
+			out.put(record);
+			out.put<uint16_t>( (uint16_t) played.size() );
+			for (size_t p = 0; p < played.size(); ++p) out.put<uint16_t>( played[p].code() );
+		}
+		for (unordered_map<uint64_t, Join>::iterator it = m_joins.begin(); it != m_joins.end(); ++it) {
+			out.put<uint64_t>(it->first);
+			out.put<int32_t>(it->second.fd);
+			out.put<uint8_t>(it->second.white);
+		}
+		uint64_t size = out.data().size();
+		struct timeval timeout = { 10, 0 };
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+		char ack;
+		bool ok = handoff_write(conn, &size, sizeof size) && handoff_write(conn, out.data().data(), size) &&
+			handoff_send_fds(conn, fds) && handoff_read(conn, &ack, 1);
+		close(conn);
+		if (!ok) fprintf(stderr, "handoff failed, carrying on\n");
+		return ok;
+	}
+	
+	// Takes over from the server listening for a handoff at path. Returns
+	// its listening socket, or -1 if no server was there.
+	int take_over(const char *path) {
+		int sock = handoff_socket(path, false);
+		if (sock < 0) return -1;
+		uint64_t size;
+		vector<uint8_t> state;
+		bool ok = handoff_read(sock, &size, sizeof size);
+		if (ok) {
+			state.resize(size);
+			ok = handoff_read(sock, state.data(), size);
+		}
+		int listen_fd = -1;
+		char ack = 1;
+		if ( !ok || !restore(state, sock, listen_fd) || !handoff_write(sock, &ack, 1) ) {
+			// The old server carries on without an acknowledgement.
+			fprintf(stderr, "%s: handoff failed\n", path);
+			exit(1);
+		}
+		close(sock);
+		return listen_fd;
+	}
+	
+	// The other half of hand_off(). Connections get new fds here and games
+	// new ids, so both are mapped as they are read. A client whose game did
+	// not come along is told the game is over and paired again.
+	bool restore(const vector<uint8_t>& state, int sock, int& listen_fd) {
+		HandoffReader in(state);
+		char magic[sizeof s_handoff_magic];
+		uint32_t clients, games, joins, trace;
+		int32_t waiting;
+		if ( !in.get(magic) || memcmp(magic, s_handoff_magic, sizeof magic) != 0 || !in.get(clients) ||
+				!in.get(games) || !in.get(joins) || !in.get(waiting) || !in.get(trace) ) return false;
+		vector<int> fds;
+		if ( !handoff_recv_fds(sock, clients + 1, fds) ) return false;
+		listen_fd = fds[0];
+		unordered_map<int, int> fd_map;
+		unordered_map<uint32_t, uint32_t> game_map;
+		for (uint32_t c = 0; c < clients; ++c) {
+			int32_t old_fd;
+			uint32_t game;
+			int64_t rtt;
+			string unread;
+			int fd = fds[c + 1];
+			if ( !in.get(old_fd) || !in.get(game) || !in.get(rtt) || !in.get_string(unread) || fd >= s_max_clients ) return false;
+			fd_map[old_fd] = fd;
+			m_clients[fd] = new Client(fd);
+			m_clients[fd]->resume(game, rtt, unread);
+		}
+		for (uint32_t g = 0; g < games; ++g) {
+			uint32_t old_id;
+			GameRecord record;
+			uint16_t plies;
+			if ( !in.get(old_id) || !in.get(record) || !in.get(plies) ) return false;
+			uint32_t id = m_games.create();
+			game_map[old_id] = id;
+			record.players[0] = fd_map[ record.players[0] ];
+			record.players[1] = fd_map[ record.players[1] ];
+			vector<Move> played(plies);
+			for (uint16_t p = 0; p < plies; ++p) {
+				uint16_t code;
+				if ( !in.get(code) ) return false;
+				played[p] = Move::from_code(code);
+			}
+			if (record.variant == VARIANT_CHESS960) record.history = replay(m_scratch960, record, played);
+			else record.history = replay(m_scratch, record, played);
+			m_games[id] = record;
+		}
+		vector<Client*> orphans;
+		for (int fd = 0; fd < s_max_clients; fd++) {
+			Client *client = m_clients[fd];
+			if (client == NULL || client->game() == GameSlab::NONE) continue;
+			unordered_map<uint32_t, uint32_t>::iterator id = game_map.find( client->game() );
+			if ( id != game_map.end() ) {
+				client->join_game(id->second);
+				continue;
+			}
+			client->leave_game();
+			client->send(string(s_prefix_game_over) + " * aborted");
+			orphans.push_back(client);
+		}
+		for (uint32_t j = 0; j < joins; ++j) {
+			uint64_t id;
+			int32_t fd;
+			uint8_t white;
+			if ( !in.get(id) || !in.get(fd) || !in.get(white) ) return false;
+			if ( fd_map.count(fd) ) {
+				Join join = { fd_map[fd], white != 0 };
+				m_joins[id] = join;
+			}
+		}
+		m_waiting = fd_map.count(waiting) ? m_clients[ fd_map[waiting] ] : NULL;
+		m_trace = trace;
+		if (!m_routed)
+			for (size_t i = 0; i < orphans.size(); ++i) pair(orphans[i]);
+		return true;
+	}
+	
+	// The History node reached by playing played from record's start.
+	template <class Engine> uint32_t replay(Engine& chess, const GameRecord& record, const vector<Move>& played) {
+		chess.set_start(record.start);
+		chess.setup();
+		uint32_t node = m_history.root(chess);
+		for (size_t p = 0; p < played.size(); ++p) {
+			chess.enter_move(played[p]);
+			node = m_history.push(node, played[p], chess);
+		}
+		return node;
+	}
+	
+	void watch(int fd) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev);
+	}
+	
+	// The archive codes moves against the standard start, so it only takes
+	// standard games.
+	void archive(const GameRecord& record) {
+		if (record.variant != VARIANT_STANDARD) return;
+		vector<Move> played;
+		m_history.moves(record.history, played);
+		ArchivedGame archived;
+		if ( !archived.encode( played.data(), (int) played.size(), &m_moves ) ) return;
+		archived.result = record.result;
+		archived.date = (uint32_t) time(NULL);
+		uint64_t archive_id = m_archive.add(archived);
+		if ( !m_index_path.empty() ) m_indexer.add( archive_id, archived.moves.data(), (int) archived.moves.size() );
+	}
+	
+	// Catches the index up with games archived while the server was not
+	// indexing them.
+	void open_index(const char *archive_path, const char *index_path) {
+		Archive archive;
+		if ( !m_indexer.open(index_path) || !archive.open(archive_path) || !m_indexer.add(archive) ) {
+			fprintf(stderr, "%s: cannot index\n", index_path);
+			return;
+		}
+		m_index_path = index_path;
+		if ( !m_indexer.commit() ) fprintf(stderr, "%s: cannot index\n", index_path);
+		m_index.open(index_path);
+	}
+	
+	// Called after the archive is flushed, so the index never names a game
+	// the archive does not have yet. The games archived since the last call
+	// are written and merged on m_index_thread, off the reactor; while one
+	// batch is being written the next waits in m_indexer.
+	void update_index() {
+		if ( m_index_path.empty() || m_index_thread.joinable() ) return;
+		m_indexer.take(m_index_batch);
+		if ( m_index_batch.empty() ) return;
+		m_index_thread = thread( [this]() {
+			m_index_ok = m_indexer.write(m_index_batch);
+			m_index_written = true;
+		} );
+	}
+	
+	// Waits for m_index_thread, if it is running, and maps what it wrote.
+	// A batch it could not write goes back to m_indexer for the next try.
+	void finish_index() {
+		if ( !m_index_thread.joinable() ) return;
+		m_index_thread.join();
+		m_index_written = false;
+		if (!m_index_ok) {
+			fprintf(stderr, "%s: cannot index\n", m_index_path.c_str());
+			m_indexer.put_back(m_index_batch);
+		}
+		m_index.open( m_index_path.c_str() );
+	}
+
+	int create_socket() {
 		struct sockaddr_in sa;
 		int fd = socket(PF_INET, SOCK_STREAM, 0);
 		sa.sin_family = AF_INET;
-		sa.sin_port = htons(s_port);
+		sa.sin_port = htons(m_port);
 		sa.sin_addr.s_addr = htonl(INADDR_ANY);
 		bind(fd, (struct sockaddr*) &sa, sizeof sa);
 		listen(fd, s_listen);
@@ -167,8 +1083,29 @@ private:
 	}
 };
 
-int main() {
-	Server server;
-	server.run();
+int main(int argc, char *argv[]) {
+	const char *log_path = NULL, *archive_path = NULL, *index_path = NULL;
+	int32_t clock_ms = 0;
+	const char *handoff_path = NULL;
+	int port = s_default_port;
+	bool routed = false, chess960 = false;
+	int opt;
+	while ( (opt = getopt(argc, argv, "l:c:a:i:p:rH:9")) != -1 ) {
+		if (opt == 'l') log_path = optarg;
+		else if (opt == 'H') handoff_path = optarg;
+		else if (opt == 'p') port = atoi(optarg);
+		else if (opt == 'r') routed = true;
+		else if (opt == '9') chess960 = true;
+		else if (opt == 'a') archive_path = optarg;
+		else if (opt == 'i') index_path = optarg;
+		else if (opt == 'c') clock_ms = atoi(optarg) * 1000;
+		else {
+			fprintf(stderr, "usage: %s [-l events.log] [-c seconds] [-a games.arc [-i games.idx]] [-p port] [-r] [-9] [-H handoff.sock]\n", argv[0]);
+			return 1;
+		}
+	}
+	srand( (unsigned) time(NULL) );
+	Server server(clock_ms, port, routed, chess960);
+	server.run(log_path, archive_path, index_path, handoff_path);
 	return 0;
 }
@@ -0,0 +1,142 @@
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "chess.hpp"
+
+using namespace std;
+
+struct Counts {
+	atomic<uint64_t>	games;
+	atomic<uint64_t>	plies;
+	atomic<uint64_t>	errors;
+};
+
+// xorshift64*, one per thread, so threads do not share rand()'s state.
+static uint64_t next_random(uint64_t& state) {
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1DULL;
+}
+
+static bool same(Chess& a, Chess& b) {
+	char fen_a[Chess::FEN_SIZE], fen_b[Chess::FEN_SIZE];
+	a.to_fen(fen_a);
+	b.to_fen(fen_b);
+	return a.hash() == b.hash() && strcmp(fen_a, fen_b) == 0;
+}
+
+// Records setup() must refuse, each for one thing wrong with it.
+static const char *s_invalid_fens[] = {
+	"4k3/8/8/8/8/8/3p4/4K3 w - d3 0 1",		// en passant target on the wrong rank
+	"4k3/8/8/8/3P4/8/8/4K3 w - d3 0 1",		// and for the side not to move
+	"4k3/8/3p4/3p4/8/8/8/4K3 w - d6 0 1",	// target occupied
+	"4k3/3p4/8/3p4/8/8/8/4K3 w - d6 0 1",	// the pawn's square before its step occupied
+	"4k3/8/8/3P4/8/8/8/4K3 w - d6 0 1",		// the pawn is the mover's own
+	"4k3/8/8/8/8/8/8/4K2K w - - 0 1",		// two white kings
+	"4k3/8/8/8/8/8/8/4K3 w - - 65536 1",	// halfmove clock past MAX_COUNTER
+};
+
+// Records setup() must accept, and then write back unchanged.
+static const char *s_valid_fens[] = {
+	"4k3/8/8/3p4/8/8/8/4K3 w - d6 0 1",
+	"4k3/8/8/8/3P4/8/8/4K3 b - d3 0 1",
+};
+
+// The errors in reading the records above, each reported on stderr.
+static uint64_t check_fens() {
+	uint64_t errors = 0;
+	for (size_t i = 0; i < sizeof s_invalid_fens / sizeof s_invalid_fens[0]; ++i) {
+		Chess chess;
+		if ( !chess.setup(s_invalid_fens[i]) ) continue;
+		fprintf(stderr, "accepted: %s\n", s_invalid_fens[i]);
+		++errors;
+	}
+	for (size_t i = 0; i < sizeof s_valid_fens / sizeof s_valid_fens[0]; ++i) {
+		Chess chess, unpacked;
+		Chess::Packed packed;
+		char fen[Chess::FEN_SIZE];
+		bool ok = chess.setup(s_valid_fens[i]);
+		if (ok) {
+			chess.to_fen(fen);
+			chess.pack(packed);
+			ok = strcmp(fen, s_valid_fens[i]) == 0 && unpacked.unpack(packed) && same(chess, unpacked);
+		}
+		if (ok) continue;
+		fprintf(stderr, "misread: %s\n", s_valid_fens[i]);
+		++errors;
+	}
+	return errors;
+}
+
+// Plays random legal games on every thread at once, each thread with its own
+// engines and nothing shared but the counters, and checks every position
+// against copies of itself: one made by the copy constructor, one read back
+// from its FEN and one unpacked from pack(). Built with -fsanitize=thread it
+// is the multi-threaded test of the rules engine's reentrancy.
+static void play(int games, int max_plies, uint64_t seed, Counts& counts) {
+	uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+	Chess chess, copy;
+	Move moves[Chess::MAX_MOVES];
+	for (int g = 0; g < games; ++g) {
+		chess.setup();
+		int ply = 0;
+		for (; ply < max_plies && chess.status() == Chess::IN_PROGRESS; ++ply) {
+			int n = chess.legal_moves(moves);
+			Move move = moves[ next_random(state) % n ];
+			copy = chess;
+			if (copy.enter_move(move) != Chess::ACCEPTED || chess.enter_move(move) != Chess::ACCEPTED || !same(chess, copy)) {
+				++counts.errors;
+				break;
+			}
+			char fen[Chess::FEN_SIZE];
+			chess.to_fen(fen);
+			Chess read;
+			Chess::Packed packed;
+			chess.pack(packed);
+			Chess unpacked;
+			if ( !read.setup(fen) || !same(chess, read) || !unpacked.unpack(packed) || !same(chess, unpacked) ) {
+				++counts.errors;
+				break;
+			}
+		}
+		++counts.games;
+		counts.plies += ply;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int threads = thread::hardware_concurrency();
+	int games = 1000;
+	int max_plies = 300;
+	uint64_t seed = 1;
+	int opt;
+	while ( (opt = getopt(argc, argv, "j:n:p:s:")) != -1 ) {
+		if (opt == 'j') threads = atoi(optarg);
+		else if (opt == 'n') games = atoi(optarg);
+		else if (opt == 'p') max_plies = atoi(optarg);
+		else if (opt == 's') seed = strtoull(optarg, NULL, 10);
+		else {
+			fprintf(stderr, "usage: %s [-j threads] [-n games_per_thread] [-p max_plies] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (threads < 1) threads = 1;
+	Counts counts;
+	counts.games = counts.plies = 0;
+	counts.errors = check_fens();
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	vector<thread> workers;
+	for (int t = 0; t < threads; ++t)
+		workers.push_back( thread(play, games, max_plies, seed + t, ref(counts)) );
+	for (size_t t = 0; t < workers.size(); ++t) workers[t].join();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	printf( "%llu games, %llu plies, %llu errors on %d threads (%.2f s)\n", (unsigned long long) counts.games.load(),
+		(unsigned long long) counts.plies.load(), (unsigned long long) counts.errors.load(), threads, seconds );
+	return counts.errors > 0 ? 1 : 0;
+}